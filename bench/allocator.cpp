@@ -0,0 +1,87 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Usage: bench_allocator [rounds] [blocks_per_thread]
+// Writer threads allocate small blocks of random orders, and a single thread
+// frees them all, as compaction does. Reports the throughput and how far the
+// used size of the block file grows beyond the live blocks.
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "core/block_manager.hpp"
+
+using namespace livegraph;
+
+int main(int argc, char **argv)
+{
+    size_t num_rounds = argc > 1 ? std::stoul(argv[1]) : 16;
+    size_t blocks_per_thread = argc > 2 ? std::stoul(argv[2]) : 1ul << 18;
+    size_t max_threads = std::thread::hardware_concurrency();
+
+    printf("threads\tops/s\tlive MB\tused MB\tfragmentation\n");
+    for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+    {
+        BlockManager manager("", 1ul << 36);
+        std::vector<std::vector<std::pair<uintptr_t, order_t>>> blocks(num_threads);
+        size_t live_size = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < num_rounds; round++)
+        {
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < num_threads; t++)
+            {
+                threads.emplace_back([&, t]() {
+                    std::mt19937 gen(round * num_threads + t);
+                    for (size_t i = 0; i < blocks_per_thread; i++)
+                    {
+                        order_t order = 5 + gen() % 8;
+                        blocks[t].emplace_back(manager.alloc(order), order);
+                    }
+                });
+            }
+            for (auto &thread : threads)
+                thread.join();
+
+            // the last round stays live
+            live_size = 0;
+            std::thread([&]() {
+                for (auto &thread_blocks : blocks)
+                {
+                    for (auto [pointer, order] : thread_blocks)
+                    {
+                        if (round + 1 < num_rounds)
+                            manager.free(pointer, order);
+                        else
+                            live_size += 1ul << order;
+                    }
+                    thread_blocks.clear();
+                }
+            }).join();
+        }
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        auto stats = manager.stats();
+        printf("%lu\t%.0f\t%.1f\t%.1f\t%.3f\n", num_threads, 2 * num_rounds * num_threads * blocks_per_thread / seconds,
+               live_size / 1048576.0, stats.used_size / 1048576.0, stats.fragmentation());
+    }
+    return 0;
+}
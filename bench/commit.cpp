@@ -0,0 +1,69 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Usage: bench_commit [wal_path] [txns_per_thread] [max_streams]
+// Measures the throughput of durable single-vertex commits from 1 to all
+// cores, with 1 to max_streams WAL streams.
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/livegraph.hpp"
+
+using namespace livegraph;
+
+int main(int argc, char **argv)
+{
+    std::string wal_path = argc > 1 ? argv[1] : "./bench_commit.wal";
+    size_t txns_per_thread = argc > 2 ? std::stoul(argv[2]) : 1ul << 12;
+    size_t max_threads = std::thread::hardware_concurrency();
+    size_t max_streams = argc > 3 ? std::stoul(argv[3]) : max_threads;
+
+    printf("threads\tstreams\tcommits/s\n");
+    for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+    {
+        for (size_t num_streams = 1; num_streams <= std::min(num_threads, max_streams); num_streams *= 2)
+        {
+            std::filesystem::remove_all(wal_path);
+            Graph graph("", wal_path, 1ul << 30, 1ul << 30, Durability::Sync, num_streams);
+
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < num_threads; t++)
+            {
+                threads.emplace_back([&]() {
+                    std::string data(64, 'x');
+                    for (size_t i = 0; i < txns_per_thread; i++)
+                    {
+                        auto txn = graph.begin_transaction();
+                        txn.put_vertex(txn.new_vertex(), data);
+                        txn.commit();
+                    }
+                });
+            }
+            for (auto &thread : threads)
+                thread.join();
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            printf("%lu\t%lu\t%.0f\n", num_threads, num_streams, num_threads * txns_per_thread / seconds);
+        }
+    }
+    std::filesystem::remove_all(wal_path);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Usage: bench_commit_latency [wal_path] [num_threads] [txns_per_thread] [durability]
+// Measures the latency percentiles of single-vertex commits under heavy
+// concurrency, 4 threads per core by default. durability is sync, async or
+// none.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/livegraph.hpp"
+
+using namespace livegraph;
+
+int main(int argc, char **argv)
+{
+    std::string wal_path = argc > 1 ? argv[1] : "./bench_commit_latency.wal";
+    size_t num_threads = argc > 2 ? std::stoul(argv[2]) : 4 * std::thread::hardware_concurrency();
+    size_t txns_per_thread = argc > 3 ? std::stoul(argv[3]) : 1ul << 12;
+    std::string durability_name = argc > 4 ? argv[4] : "sync";
+    auto durability = durability_name == "none"    ? Durability::None
+                      : durability_name == "async" ? Durability::Async
+                                                   : Durability::Sync;
+    std::filesystem::remove_all(wal_path);
+
+    std::vector<std::vector<double>> latencies(num_threads);
+    double seconds;
+    {
+        Graph graph("", wal_path, 1ul << 30, 1ul << 30, durability);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; t++)
+        {
+            threads.emplace_back([&, t]() {
+                std::string data(64, 'x');
+                latencies[t].reserve(txns_per_thread);
+                for (size_t i = 0; i < txns_per_thread; i++)
+                {
+                    auto txn = graph.begin_transaction();
+                    txn.put_vertex(txn.new_vertex(), data);
+                    auto commit_start = std::chrono::steady_clock::now();
+                    txn.commit();
+                    latencies[t].emplace_back(
+                        std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - commit_start)
+                            .count());
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::filesystem::remove_all(wal_path);
+
+    std::vector<double> all;
+    for (auto &thread_latencies : latencies)
+        all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) { return all[std::min(all.size() - 1, size_t(p * all.size()))]; };
+
+    printf("threads: %lu, durability: %s, commits/s: %.0f\n", num_threads, durability_name.c_str(),
+           all.size() / seconds);
+    printf("latency (us): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", percentile(0.5), percentile(0.99),
+           percentile(0.999), all.back());
+    return 0;
+}
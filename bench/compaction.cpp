@@ -0,0 +1,79 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Usage: bench_compaction [num_vertices] [degree] [max_threads]
+// Doubles the edges of a random graph, so each adjacency list has an old
+// version, and measures the bytes of old versions reclaimed per second by
+// compact_all with an increasing number of threads.
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "core/livegraph.hpp"
+
+using namespace livegraph;
+
+int main(int argc, char **argv)
+{
+    vertex_t num_vertices = argc > 1 ? std::stoul(argv[1]) : 1ul << 20;
+    size_t degree = argc > 2 ? std::stoul(argv[2]) : 8;
+    size_t max_threads = argc > 3 ? std::stoul(argv[3]) : std::thread::hardware_concurrency();
+
+    printf("threads\treclaimed MB\tMB/s\n");
+    for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+    {
+        Graph graph("", "", 1ul << 36, num_vertices + 1, Durability::None);
+        std::mt19937 gen(0);
+        {
+            auto txn = graph.begin_transaction();
+            for (vertex_t i = 0; i < num_vertices; i++)
+                txn.new_vertex();
+            for (vertex_t src = 0; src < num_vertices; src++)
+            {
+                for (size_t i = 0; i < degree; i++)
+                    txn.put_edge(src, 0, gen() % num_vertices, "");
+            }
+            txn.commit();
+        }
+        // doubling the edges grows a new block for every vertex
+        {
+            auto txn = graph.begin_transaction();
+            for (vertex_t src = 0; src < num_vertices; src++)
+            {
+                for (size_t i = 0; i < degree; i++)
+                    txn.put_edge(src, 0, gen() % num_vertices, "", true);
+            }
+            txn.commit();
+        }
+        {
+            // moves the epoch past the old versions
+            auto txn = graph.begin_transaction();
+            txn.new_vertex();
+            txn.commit();
+        }
+
+        auto garbage_size = graph.stats().garbage_size;
+        auto start = std::chrono::steady_clock::now();
+        graph.compact_all(num_threads);
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        auto reclaimed_size = garbage_size - graph.stats().garbage_size;
+
+        printf("%lu\t%.1f\t%.1f\n", num_threads, reclaimed_size / 1048576.0, reclaimed_size / 1048576.0 / seconds);
+    }
+    return 0;
+}
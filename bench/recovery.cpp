@@ -0,0 +1,91 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Usage: bench_recovery [wal_path] [num_vertices] [edges_per_vertex] [ops_per_txn]
+// Loads a graph through logged transactions, then measures the time to reopen
+// it from the WAL.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/livegraph.hpp"
+
+using namespace livegraph;
+
+int main(int argc, char **argv)
+{
+    std::string wal_path = argc > 1 ? argv[1] : "./bench_recovery.wal";
+    vertex_t num_vertices = argc > 2 ? std::stoul(argv[2]) : 1ul << 16;
+    size_t edges_per_vertex = argc > 3 ? std::stoul(argv[3]) : 16;
+    size_t ops_per_txn = argc > 4 ? std::stoul(argv[4]) : 64;
+    size_t num_threads = std::thread::hardware_concurrency();
+    std::filesystem::remove_all(wal_path);
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        Graph graph("", wal_path);
+        {
+            auto txn = graph.begin_transaction();
+            for (vertex_t i = 0; i < num_vertices; i++)
+                txn.new_vertex();
+            txn.commit();
+        }
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; t++)
+        {
+            threads.emplace_back([&, t]() {
+                std::mt19937_64 rand(t);
+                std::string data(16, 'x');
+                for (vertex_t src = t; src < num_vertices; src += num_threads)
+                {
+                    for (size_t i = 0; i < edges_per_vertex || i == 0; i += ops_per_txn)
+                    {
+                        auto txn = graph.begin_transaction();
+                        if (i == 0)
+                            txn.put_vertex(src, data);
+                        for (size_t j = i; j < std::min(i + ops_per_txn, edges_per_vertex); j++)
+                            txn.put_edge(src, 0, rand() % num_vertices, data, true);
+                        txn.commit();
+                    }
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+    }
+    auto load = std::chrono::steady_clock::now();
+
+    vertex_t recovered_vertices;
+    {
+        Graph graph("", wal_path);
+        recovered_vertices = graph.get_max_vertex_id();
+    }
+    auto recover = std::chrono::steady_clock::now();
+
+    printf("threads: %lu, vertices: %lu, edges: %lu\n", num_threads, recovered_vertices,
+           num_vertices * edges_per_vertex);
+    printf("load: %.3lf s, recover: %.3lf s\n", std::chrono::duration<double>(load - start).count(),
+           std::chrono::duration<double>(recover - load).count());
+
+    std::filesystem::remove_all(wal_path);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Usage: bench_scan [num_vertices] [degree] [rounds] [explicit]
+// Loads a random graph and scans the adjacency lists of all vertices in
+// random order, with normal pages and transparent huge pages. Explicit huge
+// pages are only measured when asked for, as the hugetlb pool has to hold
+// the whole graph.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "core/livegraph.hpp"
+
+using namespace livegraph;
+
+int main(int argc, char **argv)
+{
+    vertex_t num_vertices = argc > 1 ? std::stoul(argv[1]) : 1ul << 20;
+    size_t degree = argc > 2 ? std::stoul(argv[2]) : 8;
+    size_t num_rounds = argc > 3 ? std::stoul(argv[3]) : 4;
+    bool use_explicit = argc > 4 && std::string(argv[4]) == "explicit";
+
+    std::vector<std::pair<const char *, HugePages>> modes = {{"none", HugePages::None},
+                                                             {"transparent", HugePages::Transparent}};
+    if (use_explicit)
+        modes.emplace_back("explicit", HugePages::Explicit);
+
+    std::vector<vertex_t> order(num_vertices);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(0));
+
+    printf("pages\tedges/s\n");
+    for (auto [name, huge_pages] : modes)
+    {
+        Graph graph("", "", 1ul << 36, num_vertices, Durability::None, 1, huge_pages);
+        {
+            std::mt19937 gen(0);
+            auto loader = graph.begin_batch_loader();
+            for (vertex_t i = 0; i < num_vertices; i++)
+                loader.put_vertex(loader.new_vertex(), "");
+            for (size_t i = 0; i < degree; i++)
+            {
+                for (vertex_t src = 0; src < num_vertices; src++)
+                    loader.put_edge(src, 0, gen() % num_vertices, "", true);
+            }
+            loader.commit();
+        }
+
+        size_t num_edges = 0;
+        vertex_t checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < num_rounds; round++)
+        {
+            auto txn = graph.begin_read_only_transaction();
+            for (auto src : order)
+            {
+                for (auto edges = txn.get_edges(src, 0); edges.valid(); edges.next())
+                {
+                    checksum += edges.dst_id();
+                    num_edges++;
+                }
+            }
+        }
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("%s\t%.0f\t(checksum %lu)\n", name, num_edges / seconds, checksum);
+    }
+    return 0;
+}
@@ -19,8 +19,24 @@
 using namespace lg;
 namespace impl = livegraph;
 
-Graph::Graph(std::string block_path, std::string wal_path, size_t max_block_size, vertex_t max_vertex_id)
-    : graph(std::make_unique<impl::Graph>(block_path, wal_path, max_block_size, max_vertex_id))
+Graph::Graph(std::string block_path,
+             std::string wal_path,
+             size_t max_block_size,
+             vertex_t max_vertex_id,
+             Durability durability,
+             size_t num_wal_streams,
+             HugePages huge_pages,
+             NumaPlacement numa_placement,
+             std::string cold_block_path)
+    : graph(std::make_unique<impl::Graph>(block_path,
+                                          wal_path,
+                                          max_block_size,
+                                          max_vertex_id,
+                                          static_cast<impl::Durability>(durability),
+                                          num_wal_streams,
+                                          static_cast<impl::HugePages>(huge_pages),
+                                          static_cast<impl::NumaPlacement>(numa_placement),
+                                          cold_block_path))
 {
 }
 
@@ -30,8 +46,22 @@ vertex_t Graph::get_max_vertex_id() const { return graph->get_max_vertex_id(); }
 
 timestamp_t Graph::compact(timestamp_t read_epoch_id) { return graph->compact(read_epoch_id); }
 
+size_t Graph::migrate_blocks(timestamp_t read_epoch_id) { return graph->migrate_blocks(read_epoch_id); }
+
+timestamp_t Graph::checkpoint() { return graph->checkpoint(); }
+
+void Graph::follow(std::string primary_wal_path) { graph->follow(primary_wal_path); }
+
+bool Graph::is_following() const { return graph->is_following(); }
+
 Transaction Graph::begin_transaction() { return std::make_unique<impl::Transaction>(graph->begin_transaction()); }
 
+Transaction Graph::begin_transaction(Durability durability)
+{
+    return std::make_unique<impl::Transaction>(
+        graph->begin_transaction(static_cast<impl::Durability>(durability)));
+}
+
 Transaction Graph::begin_read_only_transaction()
 {
     return std::make_unique<impl::Transaction>(graph->begin_read_only_transaction());
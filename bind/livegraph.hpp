@@ -33,6 +33,27 @@ namespace lg
     using order_t = uint8_t;
     using timestamp_t = int64_t;
 
+    enum class Durability
+    {
+        Sync,
+        Async,
+        None,
+    };
+
+    enum class HugePages
+    {
+        None,
+        Transparent,
+        Explicit,
+    };
+
+    enum class NumaPlacement
+    {
+        None,
+        Local,
+        Vertex,
+    };
+
     class EdgeIterator;
     class Transaction;
 
@@ -42,14 +63,27 @@ namespace lg
         Graph(std::string block_path = "",
               std::string wal_path = "",
               size_t max_block_size = 1ul << 40,
-              vertex_t max_vertex_id = 1ul << 40);
+              vertex_t max_vertex_id = 1ul << 40,
+              Durability durability = Durability::Sync,
+              size_t num_wal_streams = 1,
+              HugePages huge_pages = HugePages::None,
+              NumaPlacement numa_placement = NumaPlacement::None,
+              std::string cold_block_path = "");
         ~Graph();
 
         vertex_t get_max_vertex_id() const;
 
         timestamp_t compact(timestamp_t read_epoch_id = NO_TRANSACTION);
 
+        size_t migrate_blocks(timestamp_t read_epoch_id = NO_TRANSACTION);
+
+        timestamp_t checkpoint();
+
+        void follow(std::string primary_wal_path);
+        bool is_following() const;
+
         Transaction begin_transaction();
+        Transaction begin_transaction(Durability durability);
         Transaction begin_read_only_transaction();
         Transaction begin_batch_loader();
 
@@ -15,41 +15,88 @@
 
 #pragma once
 
+#include <cstdio>
 #include <cstdlib>
 #include <limits>
 #include <new>
 
 #include <sys/mman.h>
 
+#include "types.hpp"
+
 namespace livegraph
 {
 
+    // The default size of the hugetlb pool.
+    inline size_t huge_page_size()
+    {
+        static const size_t size = []() {
+            size_t kb = 2048;
+            if (auto file = fopen("/proc/meminfo", "r"))
+            {
+                char line[256];
+                while (fgets(line, sizeof(line), file))
+                {
+                    if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+                        break;
+                }
+                fclose(file);
+            }
+            return kb << 10;
+        }();
+        return size;
+    }
+
     template <typename T> struct SparseArrayAllocator
     {
         using value_type = T;
 
-        SparseArrayAllocator() = default;
-        template <class U> constexpr SparseArrayAllocator(const SparseArrayAllocator<U> &) noexcept {}
+        SparseArrayAllocator(HugePages _huge_pages = HugePages::None) : huge_pages(_huge_pages) {}
+        template <class U>
+        constexpr SparseArrayAllocator(const SparseArrayAllocator<U> &other) noexcept : huge_pages(other.huge_pages)
+        {
+        }
         T *allocate(size_t n)
         {
-            size_t size = n * sizeof(T);
             if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
                 throw std::bad_alloc();
-            auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            size_t size = mapped_size(n);
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+            if (huge_pages == HugePages::Explicit)
+                flags |= MAP_HUGETLB;
+            auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
             if (data == MAP_FAILED)
                 throw std::bad_alloc();
+            if (huge_pages == HugePages::Transparent && madvise(data, size, MADV_HUGEPAGE) != 0)
+            {
+                munmap(data, size);
+                throw std::bad_alloc();
+            }
             return static_cast<T *>(data);
         }
 
-        void deallocate(T *data, size_t n) noexcept
+        void deallocate(T *data, size_t n) noexcept { munmap(data, mapped_size(n)); }
+
+        template <class U> bool operator==(const SparseArrayAllocator<U> &other)
+        {
+            return huge_pages == other.huge_pages;
+        }
+        template <class U> bool operator!=(const SparseArrayAllocator<U> &other)
         {
+            return huge_pages != other.huge_pages;
+        }
 
+        HugePages huge_pages;
+
+    private:
+        // hugetlb mappings are unmapped in whole pages
+        size_t mapped_size(size_t n) const
+        {
             size_t size = n * sizeof(T);
-            munmap(data, size);
+            if (huge_pages == HugePages::Explicit)
+                size = (size + huge_page_size() - 1) / huge_page_size() * huge_page_size();
+            return size;
         }
-
-        template <class U> bool operator==(const SparseArrayAllocator<U> &) { return true; }
-        template <class U> bool operator!=(const SparseArrayAllocator<U> &) { return false; }
     };
 
 } // namespace livegraph
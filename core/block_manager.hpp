@@ -15,119 +15,396 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_set>
 #include <vector>
 
 #include <tbb/enumerable_thread_specific.h>
 
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/magic.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
 #include <unistd.h>
 
+#include "allocator.hpp"
+#include "numa.hpp"
 #include "types.hpp"
+#include "wal.hpp"
 
 namespace livegraph
 {
+    // The block at pointer 0 is never allocated, and its beginning holds the
+    // superblock of a block file. A file closed cleanly records where its
+    // free lists and the metadata of the owner were saved, right after the
+    // used blocks.
+    struct BlockSuperblock
+    {
+        uint64_t magic;
+        uint64_t clean;
+        size_t used_size;
+        size_t metadata_offset;
+        size_t metadata_length; // free lists, then the metadata of the owner
+        uint64_t checksum;      // of the fields above
+    };
+
+    constexpr uint64_t BLOCK_SUPERBLOCK_MAGIC = 0x4b434f4c42564c47; // "GLVBLOCK"
+
+    struct BlockStats
+    {
+        size_t used_size; // of the file, by used and free blocks
+        size_t free_size;
+        size_t free_chunk_size; // in free blocks of at least a chunk, which any allocation can use
+        size_t trimmed_size;    // of the free chunks, released to the OS
+        size_t num_trims;       // free blocks released so far
+        size_t cold_used_size;  // of the cold tier, included in used_size
+        size_t file_size;       // of the blocks, grown ahead of used_size
+        // by order, of the blocks not cached by threads
+        std::vector<size_t> free_sizes;
+
+        // The share of the free space in blocks smaller than a chunk: 0 when
+        // every freed block was merged, close to 1 when it is scattered.
+        double fragmentation() const { return free_size ? 1.0 - (double)free_chunk_size / free_size : 0.0; }
+    };
+
     class BlockManager
     {
     public:
         constexpr static uintptr_t NULLPOINTER = 0; // UINTPTR_MAX;
+        constexpr static size_t LOCAL_NODE = SIZE_MAX;
 
-        BlockManager(std::string path, size_t _capacity = 1ul << 40)
-            : capacity(_capacity),
+        // A block file closed cleanly is reopened with its blocks and free
+        // lists, and get_metadata() returns what the owner saved with
+        // set_metadata(). Otherwise the file is truncated. With explicit huge
+        // pages, the block file must be on hugetlbfs.
+        //
+        // With numa, the capacity is split into a partition for every NUMA
+        // node, whose pages prefer that node, and blocks are allocated from
+        // the partition of the requested node. Only anonymous memory is
+        // supported.
+        //
+        // With a cold path, blocks can also be allocated from a cold tier of
+        // the same capacity in a file, mapped right after the blocks, e.g. on
+        // an SSD while the blocks are in DRAM. Its pages stay in the page
+        // cache until evict() or memory pressure drops them. The cold tier
+        // starts empty, so the blocks are not reopened.
+        BlockManager(std::string path,
+                     size_t _capacity = 1ul << 40,
+                     HugePages huge_pages = HugePages::None,
+                     bool numa = false,
+                     std::string cold_path = "")
+            : capacity(huge_pages == HugePages::Explicit
+                           ? (_capacity + huge_page_size() - 1) / huge_page_size() * huge_page_size()
+                           : _capacity),
+              num_partitions(numa ? numa_topology().num_nodes() : 1),
+              partition_size(num_partitions == 1 ? capacity
+                                                 : capacity / num_partitions >> LARGE_BLOCK_THRESHOLD
+                                                                                  << LARGE_BLOCK_THRESHOLD),
+              partition_used_sizes(num_partitions + 1, 0), // the last is the cold tier
+              cold_base((capacity + (1ul << LARGE_BLOCK_THRESHOLD) - 1) >> LARGE_BLOCK_THRESHOLD
+                                                                       << LARGE_BLOCK_THRESHOLD),
+              cold_fd(EMPTY_FD),
               mutex(),
-              free_blocks(std::vector<std::vector<uintptr_t>>(LARGE_BLOCK_THRESHOLD, std::vector<uintptr_t>())),
-              large_free_blocks(MAX_ORDER, std::vector<uintptr_t>())
+              free_blocks(),
+              depot(std::make_shared<Depot>(num_partitions)),
+              shared_free_blocks(MAX_ORDER, std::set<uintptr_t>()),
+              trimmed_blocks(),
+              untrimmed_size(0),
+              trimmed_size(0),
+              num_trims(0),
+              trim_threshold(NO_TRIM),
+              metadata()
         {
+            if (numa && !path.empty())
+                throw std::invalid_argument("NUMA partitions need anonymous block storage.");
+            if (!cold_path.empty())
+            {
+                cold_fd = open(cold_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0640);
+                if (cold_fd == EMPTY_FD)
+                    throw std::runtime_error("open cold block file error.");
+                if (ftruncate(cold_fd, FILE_TRUNC_SIZE) != 0)
+                    throw std::runtime_error("ftruncate cold block file error.");
+                cold_file_size = FILE_TRUNC_SIZE;
+            }
             if (path.empty())
             {
                 fd = EMPTY_FD;
-                data =
-                    mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+                if (huge_pages == HugePages::Explicit)
+                    flags |= MAP_HUGETLB;
+                data = mmap(nullptr, mapped_size(), PROT_READ | PROT_WRITE, flags, -1, 0);
                 if (data == MAP_FAILED)
                     throw std::runtime_error("mmap block error.");
             }
             else
             {
-                fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0640);
+                fd = open(path.c_str(), O_RDWR | O_CREAT, 0640);
                 if (fd == EMPTY_FD)
                     throw std::runtime_error("open block file error.");
-                if (ftruncate(fd, FILE_TRUNC_SIZE) != 0)
-                    throw std::runtime_error("ftruncate block file error.");
-                data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                struct statfs st;
+                if (huge_pages == HugePages::Explicit && (fstatfs(fd, &st) != 0 || st.f_type != HUGETLBFS_MAGIC))
+                {
+                    close(fd);
+                    throw std::invalid_argument("The block file is not on hugetlbfs.");
+                }
+                data = mmap(nullptr, mapped_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
                 if (data == MAP_FAILED)
                     throw std::runtime_error("mmap block error.");
             }
+            if (cold_fd != EMPTY_FD && mmap(reinterpret_cast<char *>(data) + cold_base, capacity,
+                                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, cold_fd, 0) == MAP_FAILED)
+                throw std::runtime_error("mmap cold block error.");
 
-            if (madvise(data, capacity, MADV_RANDOM) != 0)
+            if (huge_pages != HugePages::Explicit && madvise(data, mapped_size(), MADV_RANDOM) != 0)
                 throw std::runtime_error("madvise block error.");
+            if (huge_pages == HugePages::Transparent && madvise(data, capacity, MADV_HUGEPAGE) != 0)
+                throw std::runtime_error("madvise huge pages error.");
+            for (size_t partition = 0; numa && partition < num_partitions; partition++)
+            {
+                if (!prefer_numa_node(reinterpret_cast<char *>(data) + partition * partition_size, partition_size,
+                                      partition))
+                    throw std::runtime_error("mbind block error.");
+            }
 
-            file_size = FILE_TRUNC_SIZE;
-            used_size = 0;
-
-            null_holder = alloc(LARGE_BLOCK_THRESHOLD);
+            if (!reopen())
+            {
+                if (fd != EMPTY_FD && (ftruncate(fd, 0) != 0 || ftruncate(fd, FILE_TRUNC_SIZE) != 0))
+                    throw std::runtime_error("ftruncate block file error.");
+                file_size = FILE_TRUNC_SIZE;
+                used_size = 0;
+                null_holder = alloc(LARGE_BLOCK_THRESHOLD, 0);
+            }
         }
 
         ~BlockManager()
         {
-            free(null_holder, LARGE_BLOCK_THRESHOLD);
-            msync(data, capacity, MS_SYNC);
-            munmap(data, capacity);
+            {
+                std::lock_guard<std::mutex> lock(depot->mutex);
+                depot->closed = true;
+            }
+            if (persistent())
+                save();
+            munmap(data, mapped_size());
             if (fd != EMPTY_FD)
                 close(fd);
+            if (cold_fd != EMPTY_FD)
+                close(cold_fd);
         }
 
-        uintptr_t alloc(order_t order)
+        bool persistent() const { return fd != EMPTY_FD && cold_fd == EMPTY_FD; }
+
+        bool tiered() const { return cold_fd != EMPTY_FD; }
+
+        bool is_cold(uintptr_t block) const { return tiered() && block >= cold_base; }
+
+        size_t num_nodes() const { return num_partitions; }
+
+        // Empty unless the block file is reopened.
+        std::string_view get_metadata() const { return metadata; }
+
+        // Saved when the block file is closed, without concurrent allocations.
+        void set_metadata(std::string _metadata) { metadata = std::move(_metadata); }
+
+        // Blocks are buddies: a small block of order k lies at a multiple of
+        // 2^k inside a chunk of order LARGE_BLOCK_THRESHOLD, larger free blocks
+        // of any order are split on demand, and freed buddies are merged
+        // again, into blocks larger than a chunk too. Threads cache freed
+        // small blocks and exchange them in magazines through a depot, so the
+        // mutex of the buddies is rarely taken.
+        //
+        // Nodes only matter with numa; LOCAL_NODE is the node running the
+        // caller. Threads cache blocks of every node, and the cold tier is
+        // not cached.
+        uintptr_t alloc(order_t order, size_t node = LOCAL_NODE)
         {
-            uintptr_t pointer = NULLPOINTER;
-            if (order < LARGE_BLOCK_THRESHOLD)
+            if (order < LARGE_BLOCK_THRESHOLD && magazine_blocks(order))
             {
-                pointer = pop(free_blocks.local(), order);
+                auto &cache = local_cache();
+                auto partition = node == LOCAL_NODE ? local_partition(cache) : node_partition(node);
+                auto &blocks = cache.blocks[partition * LARGE_BLOCK_THRESHOLD + order];
+                if (blocks.empty())
+                    refill(cache, partition, order);
+                auto pointer = blocks.back();
+                blocks.pop_back();
+                cache.size.store(cache.size.load(std::memory_order_relaxed) - (1ul << order),
+                                 std::memory_order_relaxed);
+                return pointer;
             }
-            else
+
+            std::lock_guard<std::mutex> lock(mutex);
+            return split(order, node_partition(node));
+        }
+
+        void free(uintptr_t block, order_t order)
+        {
+            auto partition = block_partition(block);
+            if (order < LARGE_BLOCK_THRESHOLD && magazine_blocks(order) && partition < num_partitions)
             {
-                std::lock_guard<std::mutex> lock(mutex);
-                pointer = pop(large_free_blocks, order);
+                auto &cache = local_cache();
+                auto &blocks = cache.blocks[partition * LARGE_BLOCK_THRESHOLD + order];
+                blocks.push_back(block);
+                cache.size.store(cache.size.load(std::memory_order_relaxed) + (1ul << order),
+                                 std::memory_order_relaxed);
+                if (blocks.size() >= 2 * magazine_blocks(order))
+                    drain(cache, partition, order);
+                return;
             }
 
-            if (pointer == NULLPOINTER)
+            std::lock_guard<std::mutex> lock(mutex);
+            merge(block, order);
+        }
+
+        // Hints that a range of a block is read soon. The pages of cold
+        // blocks are read ahead in the background, and the first cache lines
+        // are prefetched. Hot blocks are assumed resident, so they cost no
+        // syscall.
+        void prefetch(uintptr_t pointer, size_t size)
+        {
+            auto begin = reinterpret_cast<char *>(data) + pointer;
+            if (is_cold(pointer))
+            {
+                static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+                auto page = reinterpret_cast<uintptr_t>(begin) & ~(page_size - 1);
+                madvise(reinterpret_cast<void *>(page), reinterpret_cast<uintptr_t>(begin) + size - page,
+                        MADV_WILLNEED);
+            }
+            for (size_t offset = 0; offset < std::min(size, MAX_PREFETCH_SIZE); offset += CACHE_LINE_SIZE)
+                __builtin_prefetch(begin + offset);
+        }
+
+        // Cold blocks are freed with free().
+        uintptr_t alloc_cold(order_t order)
+        {
+            if (!tiered())
+                throw std::invalid_argument("The block manager has no cold tier.");
+            std::lock_guard<std::mutex> lock(mutex);
+            return split(order, num_partitions);
+        }
+
+        // Writes back the pages of a range of cold blocks and drops them from
+        // memory, instead of leaving their eviction to the page cache. Best
+        // effort, the blocks are read back from the file either way.
+        void evict(uintptr_t pointer, size_t size)
+        {
+            if (!is_cold(pointer))
+                return;
+            static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+            auto begin = pointer & ~(page_size - 1);
+            auto end = (pointer + size + page_size - 1) & ~(page_size - 1);
+            auto range = reinterpret_cast<char *>(data) + begin;
+            if (msync(range, end - begin, MS_SYNC) != 0)
+                return;
+#ifdef MADV_PAGEOUT
+            if (madvise(range, end - begin, MADV_PAGEOUT) != 0)
+#endif
+                madvise(range, end - begin, MADV_DONTNEED);
+            // the pages unmapped by MADV_DONTNEED stay cached otherwise
+            posix_fadvise(cold_fd, begin - cold_base, end - begin, POSIX_FADV_DONTNEED);
+        }
+
+        BlockStats stats()
+        {
+            BlockStats stats{0, 0, 0, 0, 0, 0, 0, std::vector<size_t>(MAX_ORDER, 0)};
             {
-                size_t block_size = 1ul << order;
-                pointer = used_size.fetch_add(block_size);
+                std::lock_guard<std::mutex> lock(mutex);
+                stats.used_size = used_size;
+                stats.cold_used_size = partition_used_sizes[num_partitions];
+                stats.file_size = file_size;
+                stats.trimmed_size = trimmed_size;
+                stats.num_trims = num_trims;
+                for (order_t order = 0; order < MAX_ORDER; order++)
+                {
+                    stats.free_size += shared_free_blocks[order].size() << order;
+                    stats.free_sizes[order] += shared_free_blocks[order].size() << order;
+                    if (order >= LARGE_BLOCK_THRESHOLD)
+                        stats.free_chunk_size += shared_free_blocks[order].size() << order;
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(depot->mutex);
+                for (size_t i = 0; i < depot->magazines.size(); i++)
+                {
+                    for (auto &magazine : depot->magazines[i])
+                    {
+                        stats.free_size += magazine.size() << (i % LARGE_BLOCK_THRESHOLD);
+                        stats.free_sizes[i % LARGE_BLOCK_THRESHOLD] += magazine.size() << (i % LARGE_BLOCK_THRESHOLD);
+                    }
+                }
+                for (auto cache : depot->caches)
+                    stats.free_size += cache->size.load(std::memory_order_relaxed);
+            }
+            return stats;
+        }
+
+        // Free chunks are released to the OS by trim() once their size not yet
+        // released reaches the threshold, which is never by default.
+        void set_trim_threshold(size_t threshold) { trim_threshold = threshold; }
 
-                if (pointer + block_size >= file_size)
+        // Punches holes for the free chunks in a block file and drops their
+        // pages otherwise, so they read as zeros when allocated again.
+        // Returns the size released.
+        size_t trim(bool force = false)
+        {
+            std::vector<std::pair<uintptr_t, order_t>> blocks;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!untrimmed_size || (!force && untrimmed_size < trim_threshold))
+                    return 0;
+                // hidden from allocations until released
+                for (order_t order = LARGE_BLOCK_THRESHOLD; order < MAX_ORDER; order++)
                 {
-                    auto new_file_size = ((pointer + block_size) / FILE_TRUNC_SIZE + 1) * FILE_TRUNC_SIZE;
-                    std::lock_guard<std::mutex> lock(mutex);
-                    if (new_file_size >= file_size)
+                    for (auto iter = shared_free_blocks[order].begin(); iter != shared_free_blocks[order].end();)
                     {
-                        if (fd != EMPTY_FD)
+                        if (trimmed_blocks.count(*iter))
                         {
-                            if (ftruncate(fd, new_file_size) != 0)
-                                throw std::runtime_error("ftruncate block file error.");
+                            ++iter;
+                            continue;
                         }
-                        file_size = new_file_size;
+                        blocks.emplace_back(*iter, order);
+                        iter = shared_free_blocks[order].erase(iter);
                     }
                 }
+                untrimmed_size = 0;
             }
 
-            return pointer;
-        }
-
-        void free(uintptr_t block, order_t order)
-        {
-            if (order < LARGE_BLOCK_THRESHOLD)
+            size_t released_size = 0;
+            for (auto [pointer, order] : blocks)
             {
-                push(free_blocks.local(), order, block);
+                auto size = 1ul << order;
+                // best effort, the blocks stay free either way
+                int ret;
+                if (is_cold(pointer))
+                    ret = fallocate(cold_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pointer - cold_base, size);
+                else if (fd == EMPTY_FD)
+                    ret = madvise(reinterpret_cast<char *>(data) + pointer, size, MADV_DONTNEED);
+                else
+                    ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pointer, size);
+                if (ret == 0)
+                    released_size += size;
             }
-            else
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto [pointer, order] : blocks)
             {
-                std::lock_guard<std::mutex> lock(mutex);
-                push(large_free_blocks, order, block);
+                shared_free_blocks[order].insert(pointer);
+                trimmed_blocks.insert(pointer);
+                trimmed_size += 1ul << order;
             }
+            num_trims += blocks.size();
+            return released_size;
         }
 
         template <typename T> inline T *convert(uintptr_t block)
@@ -139,34 +416,425 @@ namespace livegraph
 
     private:
         const size_t capacity;
+        const size_t num_partitions;
+        const size_t partition_size;
+        std::vector<size_t> partition_used_sizes; // guarded by the mutex
+        const size_t cold_base;
+        int cold_fd;
+        size_t cold_file_size; // guarded by the mutex
         int fd;
         void *data;
         std::mutex mutex;
-        tbb::enumerable_thread_specific<std::vector<std::vector<uintptr_t>>> free_blocks;
-        std::vector<std::vector<uintptr_t>> large_free_blocks;
+        struct FreeBlockCache
+        {
+            FreeBlockCache() : blocks(), size(0), local_partition(0), num_allocs(0), registered(false), listed(false)
+            {
+            }
+            std::vector<std::vector<uintptr_t>> blocks; // by partition and order
+            std::atomic<size_t> size; // only written by the owner, read by stats()
+            size_t local_partition;   // of the node the owner last ran on
+            size_t num_allocs;        // from the local node, to look it up again
+            bool registered;          // to be flushed when the owner exits
+            bool listed;              // in the depot
+        };
+
+        // Magazines of small blocks that threads returned, guarded by its own
+        // mutex. Exiting threads flush their caches here until the block
+        // manager is closed.
+        struct Depot
+        {
+            Depot(size_t num_partitions)
+                : mutex(), closed(false), magazines(num_partitions * LARGE_BLOCK_THRESHOLD), caches()
+            {
+            }
+
+            void flush(FreeBlockCache &cache)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (closed)
+                    return;
+                for (size_t i = 0; i < cache.blocks.size(); i++)
+                {
+                    if (cache.blocks[i].size())
+                        magazines[i].emplace_back(std::move(cache.blocks[i]));
+                    cache.blocks[i].clear();
+                }
+                cache.size.store(0, std::memory_order_relaxed);
+                cache.registered = false;
+            }
+
+            std::mutex mutex;
+            bool closed;
+            std::vector<std::deque<std::vector<uintptr_t>>> magazines; // by partition and order
+            std::vector<FreeBlockCache *> caches; // as free_blocks is not iterable concurrently
+        };
+
+        struct ThreadCaches
+        {
+            std::vector<std::pair<std::weak_ptr<Depot>, FreeBlockCache *>> caches;
+
+            ~ThreadCaches()
+            {
+                for (auto &[weak_depot, cache] : caches)
+                {
+                    if (auto depot = weak_depot.lock())
+                        depot->flush(*cache);
+                }
+            }
+        };
+
+        tbb::enumerable_thread_specific<FreeBlockCache> free_blocks;
+        std::shared_ptr<Depot> depot;
+        std::vector<std::set<uintptr_t>> shared_free_blocks; // address ordered, guarded by the mutex
+        std::unordered_set<uintptr_t> trimmed_blocks;        // free chunks released, guarded by the mutex
+        size_t untrimmed_size, trimmed_size, num_trims;      // guarded by the mutex
+        std::atomic<size_t> trim_threshold;
         std::atomic<size_t> used_size, file_size;
         uintptr_t null_holder;
+        std::string metadata;
+
+        static uint64_t superblock_checksum(const BlockSuperblock &superblock)
+        {
+            return wal_checksum(
+                std::string_view(reinterpret_cast<const char *>(&superblock), offsetof(BlockSuperblock, checksum)));
+        }
 
-        uintptr_t pop(std::vector<std::vector<uintptr_t>> &free_block, order_t order)
+        bool write_superblock(BlockSuperblock superblock)
         {
-            uintptr_t pointer = NULLPOINTER;
-            if (free_block[order].size())
+            superblock.checksum = superblock_checksum(superblock);
+            return pwrite(fd, &superblock, sizeof(superblock), 0) == sizeof(superblock) && fdatasync(fd) == 0;
+        }
+
+        // Restores a block file closed cleanly, which is no longer clean until
+        // it is closed again.
+        bool reopen()
+        {
+            if (!persistent())
+                return false;
+            BlockSuperblock superblock;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(superblock) ||
+                pread(fd, &superblock, sizeof(superblock), 0) != sizeof(superblock))
+                return false;
+            if (superblock.magic != BLOCK_SUPERBLOCK_MAGIC || !superblock.clean ||
+                superblock.checksum != superblock_checksum(superblock) || superblock.used_size > capacity ||
+                superblock.metadata_offset < superblock.used_size ||
+                superblock.metadata_offset + superblock.metadata_length > (size_t)st.st_size)
+                return false;
+
+            std::string saved(superblock.metadata_length, '\0');
+            if (pread(fd, saved.data(), saved.size(), superblock.metadata_offset) != (ssize_t)saved.size())
+                return false;
+            size_t offset = 0;
+            auto read = [&]() {
+                uint64_t value;
+                if (saved.size() - offset < sizeof(value))
+                    throw std::runtime_error("read block metadata error.");
+                memcpy(&value, saved.data() + offset, sizeof(value));
+                offset += sizeof(value);
+                return value;
+            };
+            for (order_t order = 0; order < MAX_ORDER; order++)
+            {
+                for (auto num_blocks = read(); num_blocks; num_blocks--)
+                    merge(read(), order);
+            }
+            metadata = saved.substr(offset);
+
+            // chunks of small blocks are aligned to their size
+            used_size = (superblock.used_size + (1ul << LARGE_BLOCK_THRESHOLD) - 1) &
+                        ~((1ul << LARGE_BLOCK_THRESHOLD) - 1);
+            partition_used_sizes[0] = used_size;
+            file_size = st.st_size;
+            null_holder = NULLPOINTER;
+            superblock.clean = false;
+            if (!write_superblock(superblock))
+                throw std::runtime_error("write block superblock error.");
+            return true;
+        }
+
+        // Best effort: the file is only marked clean once everything is saved.
+        void save()
+        {
+            std::string saved;
+            auto append = [&](uint64_t value) { saved.append(reinterpret_cast<char *>(&value), sizeof(value)); };
+            for (order_t order = 0; order < MAX_ORDER; order++)
+            {
+                auto num_blocks = shared_free_blocks[order].size();
+                std::vector<const std::vector<uintptr_t> *> cached;
+                for (size_t partition = 0; order < LARGE_BLOCK_THRESHOLD && partition < num_partitions; partition++)
+                {
+                    auto i = partition * LARGE_BLOCK_THRESHOLD + order;
+                    for (auto &cache : free_blocks)
+                    {
+                        if (i < cache.blocks.size())
+                            cached.push_back(&cache.blocks[i]);
+                    }
+                    for (auto &magazine : depot->magazines[i])
+                        cached.push_back(&magazine);
+                }
+                for (auto blocks : cached)
+                    num_blocks += blocks->size();
+                append(num_blocks);
+                for (auto pointer : shared_free_blocks[order])
+                    append(pointer);
+                for (auto blocks : cached)
+                {
+                    for (auto pointer : *blocks)
+                        append(pointer);
+                }
+            }
+            saved.append(metadata);
+
+            BlockSuperblock superblock{BLOCK_SUPERBLOCK_MAGIC, true, used_size, used_size, saved.size(), 0};
+            if (superblock.metadata_offset + saved.size() > file_size &&
+                ftruncate(fd, superblock.metadata_offset + saved.size()) != 0)
+                return;
+            if (pwrite(fd, saved.data(), saved.size(), superblock.metadata_offset) != (ssize_t)saved.size())
+                return;
+            if (msync(data, used_size, MS_SYNC) != 0 || fdatasync(fd) != 0)
+                return;
+            write_superblock(superblock);
+        }
+
+        size_t mapped_size() const { return tiered() ? cold_base + capacity : capacity; }
+
+        // The cold tier is the partition after those of the nodes.
+        size_t partition_base(size_t partition) const
+        {
+            return partition == num_partitions ? cold_base : partition * partition_size;
+        }
+
+        size_t partition_limit(size_t partition) const
+        {
+            return partition == num_partitions ? capacity : partition_size;
+        }
+
+        size_t block_partition(uintptr_t block) const
+        {
+            return is_cold(block) ? num_partitions : block / partition_size;
+        }
+
+        size_t node_partition(size_t node) const
+        {
+            if (num_partitions == 1)
+                return 0;
+            return node == LOCAL_NODE ? current_numa_node() : node % num_partitions;
+        }
+
+        // Orders without magazines are not cached by threads.
+        static size_t magazine_blocks(order_t order) { return MAGAZINE_SIZE >> order; }
+
+        FreeBlockCache &local_cache()
+        {
+            auto &cache = free_blocks.local();
+            if (__builtin_expect(!cache.registered, 0))
+            {
+                thread_local ThreadCaches thread_caches;
+                auto &caches = thread_caches.caches;
+                caches.erase(std::remove_if(caches.begin(), caches.end(),
+                                            [](const auto &entry) { return entry.first.expired(); }),
+                             caches.end());
+                caches.emplace_back(depot, &cache);
+                cache.registered = true;
+                cache.blocks.resize(num_partitions * LARGE_BLOCK_THRESHOLD);
+                if (!cache.listed)
+                {
+                    std::lock_guard<std::mutex> lock(depot->mutex);
+                    depot->caches.push_back(&cache);
+                    cache.listed = true;
+                }
+            }
+            return cache;
+        }
+
+        // Looks up the node again every NODE_LOOKUP_INTERVAL allocations, as
+        // the thread may have moved.
+        size_t local_partition(FreeBlockCache &cache)
+        {
+            if (num_partitions == 1)
+                return 0;
+            if (cache.num_allocs++ % NODE_LOOKUP_INTERVAL == 0)
+                cache.local_partition = current_numa_node();
+            return cache.local_partition;
+        }
+
+        // Takes a magazine from the depot, or splits one from the buddies.
+        void refill(FreeBlockCache &cache, size_t partition, order_t order)
+        {
+            auto i = partition * LARGE_BLOCK_THRESHOLD + order;
+            auto &blocks = cache.blocks[i];
+            {
+                std::lock_guard<std::mutex> lock(depot->mutex);
+                auto &magazines = depot->magazines[i];
+                if (magazines.size())
+                {
+                    blocks.swap(magazines.back());
+                    magazines.pop_back();
+                }
+            }
+            if (blocks.empty())
             {
-                pointer = free_block[order].back();
-                free_block[order].pop_back();
+                std::lock_guard<std::mutex> lock(mutex);
+                for (size_t i = 0; i < magazine_blocks(order); i++)
+                    blocks.push_back(split(order, partition));
+                std::reverse(blocks.begin(), blocks.end()); // lowest first
+            }
+            cache.size.store(cache.size.load(std::memory_order_relaxed) + (blocks.size() << order),
+                             std::memory_order_relaxed);
+        }
+
+        // Returns the older half of a full cache to the depot, and the oldest
+        // magazine of a full depot to the buddies.
+        void drain(FreeBlockCache &cache, size_t partition, order_t order)
+        {
+            auto i = partition * LARGE_BLOCK_THRESHOLD + order;
+            auto &blocks = cache.blocks[i];
+            std::vector<uintptr_t> magazine(blocks.begin(), blocks.begin() + magazine_blocks(order));
+            blocks.erase(blocks.begin(), blocks.begin() + magazine.size());
+            cache.size.store(cache.size.load(std::memory_order_relaxed) - (magazine.size() << order),
+                             std::memory_order_relaxed);
+
+            std::vector<uintptr_t> surplus;
+            {
+                std::lock_guard<std::mutex> lock(depot->mutex);
+                auto &magazines = depot->magazines[i];
+                magazines.emplace_back(std::move(magazine));
+                if (magazines.size() > DEPOT_MAGAZINES)
+                {
+                    surplus = std::move(magazines.front());
+                    magazines.pop_front();
+                }
+            }
+            if (surplus.size())
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto pointer : surplus)
+                    merge(pointer, order);
             }
+        }
+
+        // Called with the mutex held. Blocks come from the lowest free block
+        // of the smallest order that fits, whose unused halves are freed.
+        // Halves of trimmed blocks stay trimmed.
+        uintptr_t split(order_t order, size_t partition)
+        {
+            auto pointer = NULLPOINTER;
+            auto split_order = order;
+            bool trimmed = false;
+            for (; split_order < MAX_ORDER; split_order++)
+            {
+                auto iter = find_free(split_order, partition);
+                if (iter != shared_free_blocks[split_order].end())
+                {
+                    trimmed = split_order >= LARGE_BLOCK_THRESHOLD && trimmed_blocks.count(*iter);
+                    pointer = pop(split_order, iter);
+                    break;
+                }
+            }
+            if (pointer == NULLPOINTER)
+            {
+                split_order = std::max(order, LARGE_BLOCK_THRESHOLD);
+                pointer = grow(split_order, partition);
+            }
+            while (split_order > order)
+            {
+                split_order--;
+                auto half = pointer + (1ul << split_order);
+                shared_free_blocks[split_order].insert(half);
+                if (split_order >= LARGE_BLOCK_THRESHOLD && trimmed)
+                {
+                    trimmed_blocks.insert(half);
+                    trimmed_size += 1ul << split_order;
+                }
+                else if (split_order >= LARGE_BLOCK_THRESHOLD)
+                    untrimmed_size += 1ul << split_order;
+            }
+            return pointer;
+        }
+
+        std::set<uintptr_t>::iterator find_free(order_t order, size_t partition)
+        {
+            auto base = partition_base(partition);
+            auto iter = shared_free_blocks[order].lower_bound(base);
+            if (iter != shared_free_blocks[order].end() && *iter >= base + partition_limit(partition))
+                return shared_free_blocks[order].end();
+            return iter;
+        }
+
+        uintptr_t pop(order_t order, std::set<uintptr_t>::iterator iter)
+        {
+            auto pointer = *iter;
+            shared_free_blocks[order].erase(iter);
+            if (order >= LARGE_BLOCK_THRESHOLD && trimmed_blocks.erase(pointer))
+                trimmed_size -= 1ul << order;
+            else if (order >= LARGE_BLOCK_THRESHOLD)
+                untrimmed_size -= 1ul << order;
             return pointer;
         }
 
-        void push(std::vector<std::vector<uintptr_t>> &free_block, order_t order, uintptr_t pointer)
+        // Called with the mutex held. Large blocks are only aligned to the
+        // chunk size, but a buddy found by flipping the bit of the order is
+        // still the adjacent block of the same size, so they merge as well
+        // inside a partition. A merged block needs a trim again.
+        void merge(uintptr_t pointer, order_t order)
+        {
+            for (; order + 1 < MAX_ORDER; order++)
+            {
+                auto buddy = shared_free_blocks[order].find(pointer ^ (1ul << order));
+                if (buddy == shared_free_blocks[order].end() || block_partition(*buddy) != block_partition(pointer))
+                    break;
+                pointer = std::min(pointer, pop(order, buddy));
+            }
+            shared_free_blocks[order].insert(pointer);
+            if (order >= LARGE_BLOCK_THRESHOLD)
+                untrimmed_size += 1ul << order;
+        }
+
+        // Called with the mutex held. Keeps used sizes multiples of the
+        // chunk size, as every grown block is at least a chunk.
+        uintptr_t grow(order_t order, size_t partition)
         {
-            free_block[order].push_back(pointer);
+            size_t block_size = 1ul << order;
+            if (partition_used_sizes[partition] + block_size > partition_limit(partition))
+                throw std::runtime_error("alloc block error.");
+            uintptr_t pointer = partition_base(partition) + partition_used_sizes[partition];
+            partition_used_sizes[partition] += block_size;
+            used_size += block_size;
+
+            if (partition == num_partitions)
+            {
+                auto end = partition_used_sizes[partition];
+                if (end >= cold_file_size)
+                {
+                    auto new_file_size = (end / FILE_TRUNC_SIZE + 1) * FILE_TRUNC_SIZE;
+                    if (ftruncate(cold_fd, new_file_size) != 0)
+                        throw std::runtime_error("ftruncate cold block file error.");
+                    cold_file_size = new_file_size;
+                }
+                return pointer;
+            }
+
+            if (pointer + block_size >= file_size)
+            {
+                auto new_file_size = ((pointer + block_size) / FILE_TRUNC_SIZE + 1) * FILE_TRUNC_SIZE;
+                if (fd != EMPTY_FD && ftruncate(fd, new_file_size) != 0)
+                    throw std::runtime_error("ftruncate block file error.");
+                file_size = new_file_size;
+            }
+            return pointer;
         }
 
         constexpr static int EMPTY_FD = -1;
         constexpr static order_t MAX_ORDER = 64;
         constexpr static order_t LARGE_BLOCK_THRESHOLD = 20;
         constexpr static size_t FILE_TRUNC_SIZE = 1ul << 30; // 1GB
+        constexpr static size_t MAGAZINE_SIZE = 1ul << 15;    // in bytes, a thread caches up to two
+        constexpr static size_t DEPOT_MAGAZINES = 32;         // per partition and order
+        constexpr static size_t NODE_LOOKUP_INTERVAL = 1ul << 10;
+        constexpr static size_t NO_TRIM = SIZE_MAX;
+        constexpr static size_t CACHE_LINE_SIZE = 64;
+        constexpr static size_t MAX_PREFETCH_SIZE = 1ul << 9;
     };
 
     class BlockManagerLibc
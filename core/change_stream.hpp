@@ -0,0 +1,199 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "types.hpp"
+#include "wal.hpp"
+
+namespace livegraph
+{
+    // A committed transaction delivered by a ChangeStream.
+    struct ChangeRecord
+    {
+        timestamp_t epoch_id;
+        std::vector<WALOperation> operations;
+        std::shared_ptr<const std::string> group; // keeps the data of operations alive
+    };
+
+    // The logged transactions committed after start_epoch_id, delivered in
+    // commit order once they are visible. A consumer that falls more than
+    // capacity transactions behind loses the stream and has to subscribe
+    // again.
+    class ChangeStream
+    {
+    public:
+        ChangeStream(size_t _capacity, timestamp_t _start_epoch_id)
+            : capacity(_capacity),
+              start_epoch_id(_start_epoch_id),
+              mutex(),
+              cv(),
+              groups(),
+              num_txns(0),
+              overflowed(false),
+              reader(std::string_view())
+        {
+        }
+
+        ChangeStream(const ChangeStream &) = delete;
+
+        ChangeStream(ChangeStream &&) = delete;
+
+        timestamp_t get_start_epoch_id() const { return start_epoch_id; }
+
+        bool is_overflowed() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return overflowed;
+        }
+
+        // Waits up to timeout for the next transaction. Returns false if there
+        // is none or the stream is overflowed.
+        template <class Rep, class Period>
+        bool next(ChangeRecord &record, const std::chrono::duration<Rep, Period> &timeout)
+        {
+            if (reader.empty())
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!cv.wait_for(lock, timeout, [&]() { return overflowed || !groups.empty(); }) || overflowed)
+                    return false;
+                std::tie(current_epoch_id, current_group, std::ignore) = std::move(groups.front());
+                num_txns -= std::get<2>(groups.front());
+                groups.pop_front();
+                reader = WALReader(*current_group);
+            }
+
+            record.epoch_id = current_epoch_id;
+            record.operations.clear();
+            reader.read_transaction([&](WALOperation op) { record.operations.emplace_back(op); });
+            record.group = current_group;
+            return true;
+        }
+
+    private:
+        const size_t capacity;
+        const timestamp_t start_epoch_id;
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::tuple<timestamp_t, std::shared_ptr<const std::string>, size_t>> groups; // txns of a group
+        size_t num_txns;
+        bool overflowed;
+        WALReader reader; // (consumer) over the current group
+        timestamp_t current_epoch_id;
+        std::shared_ptr<const std::string> current_group;
+
+        void push(timestamp_t epoch_id, const std::shared_ptr<const std::string> &group, size_t group_num_txns)
+        {
+            if (epoch_id <= start_epoch_id)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (overflowed)
+                    return;
+                // a group larger than capacity is still accepted by an empty stream
+                if (!groups.empty() && num_txns + group_num_txns > capacity)
+                {
+                    overflowed = true;
+                    groups.clear();
+                }
+                else
+                {
+                    groups.emplace_back(epoch_id, group, group_num_txns);
+                    num_txns += group_num_txns;
+                }
+            }
+            cv.notify_one();
+        }
+
+        friend class ChangeHub;
+    };
+
+    // Collects the txn records of groups while they are written, and hands
+    // them to the subscribed streams in epoch order as they become visible.
+    class ChangeHub
+    {
+    public:
+        ChangeHub() : mutex(), streams(), staged_groups(), num_streams(0), num_staged(0) {}
+
+        // Groups are only staged while there are subscribers.
+        bool active() const { return num_streams.load(std::memory_order_acquire); }
+
+        void subscribe(const std::shared_ptr<ChangeStream> &stream)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            streams.emplace_back(stream);
+            num_streams.fetch_add(1);
+        }
+
+        // (server) before the epoch may become visible
+        void stage(timestamp_t epoch_id, const std::vector<std::string_view> &txns)
+        {
+            auto group = std::make_shared<std::string>();
+            for (auto txn : txns)
+                group->append(txn);
+            std::lock_guard<std::mutex> lock(mutex);
+            staged_groups.emplace(epoch_id, std::make_pair(std::move(group), txns.size()));
+            num_staged.fetch_add(1);
+        }
+
+        // Called for every epoch in order as it becomes visible.
+        void publish(timestamp_t epoch_id)
+        {
+            if (!num_staged.load(std::memory_order_acquire))
+                return;
+            std::lock_guard<std::mutex> lock(mutex);
+            auto iter = staged_groups.find(epoch_id);
+            if (iter == staged_groups.end())
+                return;
+            auto [group, num_txns] = std::move(iter->second);
+            staged_groups.erase(iter);
+            num_staged.fetch_sub(1);
+
+            for (size_t i = 0; i < streams.size();)
+            {
+                if (auto stream = streams[i].lock())
+                {
+                    stream->push(epoch_id, group, num_txns);
+                    i++;
+                }
+                else
+                {
+                    streams[i] = streams.back();
+                    streams.pop_back();
+                    num_streams.fetch_sub(1);
+                }
+            }
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<std::weak_ptr<ChangeStream>> streams;
+        std::map<timestamp_t, std::pair<std::shared_ptr<const std::string>, size_t>> staged_groups; // txns, num
+        std::atomic<size_t> num_streams;
+        std::atomic<size_t> num_staged;
+    };
+
+} // namespace livegraph
@@ -15,16 +15,18 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
-#include <condition_variable>
-#include <mutex>
-#include <queue>
+#include <memory>
+#include <string>
 #include <thread>
+#include <vector>
 
-#include <fcntl.h>
 #include <unistd.h>
 
 #include "types.hpp"
+#include "wal.hpp"
+#include "wal_stream.hpp"
 
 namespace livegraph
 {
@@ -32,205 +34,125 @@ namespace livegraph
     class CommitManager
     {
     public:
-        CommitManager(std::string path, std::atomic<timestamp_t> &_global_epoch_id)
-            : fd(EMPTY_FD),
-              seq_front{0, 0},
-              seq_rear{0, 0},
-              mutex(),
-              client_mutex(),
-              cv_server(),
-              cv_client(),
-              global_client_mutex(0),
-              used_size(0),
-              file_size(0),
+        // Transactions of a thread always go to the same one of num_streams
+        // WAL streams, each with its own server thread and directory of
+        // segments. Stream 0 is the directory at path, and stream i is its
+        // subdirectory i. Epochs are assigned across streams in order.
+        CommitManager(std::string _path,
+                      std::atomic<timestamp_t> &_global_epoch_id,
+                      size_t num_streams = 1,
+                      size_t segment_size = DEFAULT_SEGMENT_SIZE,
+                      bool use_io_uring = true)
+            : path(_path),
               global_epoch_id(_global_epoch_id),
-              writing_epoch_id(global_epoch_id),
-              unfinished_epoch_id(),
-              queue(),
-              closed(false),
-              server_thread([&] { server_loop(); })
+              sequencer(_global_epoch_id),
+              num_active_streams(path.empty() ? 1 : std::max<size_t>(num_streams, 1)),
+              streams()
         {
-            if (!path.empty())
-            {
-                fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0640);
-                if (fd == EMPTY_FD)
-                    throw std::runtime_error("open wal file error.");
-                if (ftruncate(fd, FILE_TRUNC_SIZE) != 0)
-                    throw std::runtime_error("ftruncate wal file error.");
-            }
-            file_size = FILE_TRUNC_SIZE;
+            // streams of an earlier run are recovered even if they are no
+            // longer used, until a checkpoint releases their segments
+            auto num_opened_streams = num_active_streams;
+            while (!path.empty() && access(stream_path(num_opened_streams).c_str(), F_OK) == 0)
+                ++num_opened_streams;
+            for (size_t i = 0; i < num_opened_streams; i++)
+                streams.emplace_back(
+                    std::make_unique<WALStream>(stream_path(i), sequencer, segment_size, use_io_uring));
         }
 
-        ~CommitManager()
+        // Called once before any commit. Calls replay(header, txns) for every
+        // group after begin_epoch_id in commit order, up to the first epoch
+        // lost in all streams, and flush() before the txns are unmapped. Then
+        // continues every stream after its last replayed group and returns
+        // the epoch of the last group.
+        template <typename F, typename G> timestamp_t recover(timestamp_t begin_epoch_id, F replay, G flush)
         {
-            closed.store(true);
-            cv_server.notify_one();
-            server_thread.join();
-            if (fd != EMPTY_FD)
-                close(fd);
-        }
+            std::vector<std::vector<std::pair<WALGroupHeader, std::string_view>>> groups(streams.size());
+            for (size_t i = 0; i < streams.size(); i++)
+                streams[i]->scan(begin_epoch_id, groups[i]);
 
-        std::pair<timestamp_t, std::atomic<int> *> register_commit(std::string_view wal)
-        {
+            // merges the streams by epoch
+            timestamp_t recovered_epoch_id = begin_epoch_id;
+            std::vector<size_t> cursors(streams.size(), 0);
             while (true)
             {
-                auto local_client_mutex = global_client_mutex.load();
-                std::unique_lock<std::mutex> lock(mutex[local_client_mutex]);
-                if (local_client_mutex != global_client_mutex.load())
-                    continue;
-
-                timestamp_t local_commit_epoch_id;
-                std::atomic<int> *local_num_unfinished;
-
-                queue[local_client_mutex].emplace(wal, &local_commit_epoch_id, &local_num_unfinished);
-                auto my_seq = seq_rear[local_client_mutex]++;
-
-                lock.unlock();
-                cv_server.notify_one();
-
-                std::unique_lock<std::mutex> client_lock(client_mutex[local_client_mutex]);
-                if (seq_front[local_client_mutex] <= my_seq)
+                size_t next = streams.size();
+                for (size_t i = 0; i < streams.size(); i++)
                 {
-                    cv_client[local_client_mutex].wait(client_lock,
-                                                       [&]() { return seq_front[local_client_mutex] > my_seq; });
+                    if (cursors[i] < groups[i].size() &&
+                        (next == streams.size() ||
+                         groups[i][cursors[i]].first.epoch_id < groups[next][cursors[next]].first.epoch_id))
+                        next = i;
                 }
-
-                return {local_commit_epoch_id, local_num_unfinished};
+                if (next == streams.size())
+                    break;
+                auto &[header, txns] = groups[next][cursors[next]++];
+                // an earlier group of another stream was not flushed
+                if (header.prev_epoch_id > recovered_epoch_id)
+                    break;
+                replay(header, txns);
+                recovered_epoch_id = header.epoch_id;
             }
+            flush();
+
+            for (auto &stream : streams)
+                stream->finish_recovery(recovered_epoch_id);
+            sequencer.reset(recovered_epoch_id);
+            return recovered_epoch_id;
+        }
+
+        // Releases the segments whose groups are all covered by a checkpoint
+        // at epoch_id. They are recycled as future segments or deleted.
+        void truncate(timestamp_t epoch_id)
+        {
+            for (auto &stream : streams)
+                stream->truncate(epoch_id);
         }
 
+        // Transactions with Durability::None pass no wal; they are only
+        // assigned an epoch, without waiting for a stream. Sync ones return
+        // once the earlier epochs of all streams are flushed too.
+        std::pair<timestamp_t, std::atomic<int> *> register_commit(std::string_view wal, Durability durability)
+        {
+            if (durability == Durability::None)
+                return sequencer.next_epoch(false);
+            auto commit = streams[stream_index()]->register_commit(wal, durability);
+            if (durability == Durability::Sync)
+                sequencer.wait_durable(commit.first);
+            return commit;
+        }
+
+        std::shared_ptr<ChangeStream> subscribe(size_t capacity) { return sequencer.subscribe(capacity); }
+
         void finish_commit(timestamp_t local_commit_epoch_id, std::atomic<int> *local_num_unfinished, bool wait)
         {
             local_num_unfinished->fetch_sub(1);
             while (wait && global_epoch_id < local_commit_epoch_id)
             {
-                cv_server.notify_one();
+                sequencer.advance();
                 std::this_thread::yield();
             }
         }
 
     private:
-        int fd;
-        size_t seq_front[2];                  //(server) increment after fsync() is finished
-        size_t seq_rear[2];                   // (client) increment after push() is finished
-        std::mutex mutex[2];                  // (server/clients) serialize queue operations
-        std::mutex client_mutex[2];           // (clients) wait for fsync() to finish
-        std::condition_variable cv_server;    // (server) wait when the queue is empty
-        std::condition_variable cv_client[2]; // (clients) wait for fsync() to finish
-        std::atomic<int> global_client_mutex;
-        size_t used_size;
-        size_t file_size;
+        const std::string path;
         std::atomic<timestamp_t> &global_epoch_id;
-        timestamp_t writing_epoch_id;
-        std::queue<std::pair<timestamp_t, std::atomic<int>>> unfinished_epoch_id;
-        std::queue<std::tuple<std::string_view, timestamp_t *, std::atomic<int> **>>
-            queue[2]; // wal, epoch_id, unfinished
-        std::atomic<bool> closed;
-        std::thread server_thread;
-
-        constexpr static size_t FILE_TRUNC_SIZE = 1ul << 30; // 1GB
-        constexpr static int EMPTY_FD = -1;
-        constexpr static auto SERVER_SPIN_INTERVAL = std::chrono::microseconds(100);
-
-        void check_unfinished_epoch_id()
+        EpochSequencer sequencer;
+        const size_t num_active_streams;
+        std::vector<std::unique_ptr<WALStream>> streams;
+
+        constexpr static size_t DEFAULT_SEGMENT_SIZE = 1ul << 26; // 64MB
+
+        std::string stream_path(size_t i) const
         {
-            while (!unfinished_epoch_id.empty())
-            {
-                auto &[current_epoch_id, num_unfinished] = unfinished_epoch_id.front();
-                if (num_unfinished.load() == 0)
-                {
-                    global_epoch_id = current_epoch_id;
-                    unfinished_epoch_id.pop();
-                }
-                else
-                {
-                    break;
-                }
-            }
+            return i == 0 || path.empty() ? path : path + "/" + std::to_string(i);
         }
 
-        void server_loop()
+        // threads are spread over the streams in the order of their first commit
+        size_t stream_index() const
         {
-            while (true)
-            {
-                check_unfinished_epoch_id();
-                int local_client_mutex = global_client_mutex.load();
-                std::unique_lock<std::mutex> lock(mutex[local_client_mutex]);
-                auto &local_queue = queue[local_client_mutex];
-                while (local_queue.empty() && !closed.load())
-                {
-                    cv_server.wait_for(lock, SERVER_SPIN_INTERVAL, [&]() {
-                        check_unfinished_epoch_id();
-                        return !local_queue.empty() || closed.load();
-                    });
-                    check_unfinished_epoch_id();
-                    cv_client[local_client_mutex ^ 1].notify_all();
-                }
-                std::unique_lock<std::mutex> client_lock(client_mutex[local_client_mutex]);
-
-                global_client_mutex ^= 1;
-
-                size_t num_txns = local_queue.size();
-
-                if (!num_txns)
-                    break;
-
-                ++writing_epoch_id;
-
-                unfinished_epoch_id.emplace(writing_epoch_id, 0);
-
-                auto &num_unfinished = unfinished_epoch_id.back().second;
-
-                std::string group_wal;
-                group_wal.append(reinterpret_cast<char *>(&writing_epoch_id), sizeof(writing_epoch_id));
-                group_wal.append(reinterpret_cast<char *>(&num_txns), sizeof(num_txns));
-
-                for (size_t i = 0; i < num_txns; i++)
-                {
-                    auto &[wal, ret_epoch_id, ret_num] = local_queue.front();
-
-                    group_wal.append(wal);
-                    *ret_epoch_id = writing_epoch_id;
-                    *ret_num = &num_unfinished;
-                    ++num_unfinished;
-                    local_queue.pop();
-                }
-
-                auto expected_size = used_size + group_wal.size();
-                if (expected_size > file_size)
-                {
-                    size_t new_file_size = (expected_size / FILE_TRUNC_SIZE + 1) * FILE_TRUNC_SIZE;
-                    if (fd != EMPTY_FD)
-                    {
-                        if (ftruncate(fd, new_file_size) != 0)
-                            throw std::runtime_error("ftruncate wal file error.");
-                    }
-                    file_size = new_file_size;
-                }
-
-                used_size += group_wal.size();
-
-                if (fd != EMPTY_FD)
-                {
-                    if ((size_t)write(fd, group_wal.c_str(), group_wal.size()) != group_wal.size())
-                        std::runtime_error("write wal file error.");
-                }
-
-                if (fd != EMPTY_FD)
-                {
-                    if (fdatasync(fd) != 0)
-                        std::runtime_error("fdatasync wal file error.");
-                }
-
-                ++num_unfinished;
-
-                lock.unlock();
-                seq_front[local_client_mutex] += num_txns;
-                cv_client[local_client_mutex].notify_all();
-                client_lock.unlock();
-
-                --num_unfinished;
-            }
+            static std::atomic<size_t> num_threads(0);
+            thread_local size_t thread_index = num_threads++;
+            return thread_index % num_active_streams;
         }
     };
 
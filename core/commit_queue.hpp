@@ -0,0 +1,148 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+#include "futex.hpp"
+#include "types.hpp"
+
+namespace livegraph
+{
+    // A bounded lock-free ring of commits from many clients to one server.
+    // Clients take slots in order by a ticket and wait on their own slot
+    // until the server releases it, so they never share a mutex. The server
+    // drains the published slots in ticket order.
+    class CommitQueue
+    {
+    public:
+        struct alignas(64) Slot
+        {
+            std::atomic<uint64_t> seq; // ticket + 1 once published, ticket + capacity once free
+            std::atomic<int> state;    // futex word of the client
+            Durability durability;
+            std::string_view wal;
+            timestamp_t epoch_id;              // set by the server
+            std::atomic<int> *num_unfinished; // set by the server
+        };
+
+        CommitQueue(size_t _capacity)
+            : capacity(_capacity), slots(new Slot[capacity]), head(0), tail(0), server_state(RUNNING)
+        {
+            if (capacity & (capacity - 1))
+                throw std::invalid_argument("The capacity should be a power of 2.");
+            for (size_t i = 0; i < capacity; i++)
+                slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        CommitQueue(const CommitQueue &) = delete;
+
+        CommitQueue(CommitQueue &&) = delete;
+
+        // (client) returns the ticket of the commit
+        uint64_t push(std::string_view wal, Durability durability)
+        {
+            auto ticket = tail.fetch_add(1);
+            auto &slot = at(ticket);
+            // the ring is full until the client of ticket - capacity leaves
+            while (slot.seq.load(std::memory_order_acquire) != ticket)
+                std::this_thread::yield();
+            slot.wal = wal;
+            slot.durability = durability;
+            slot.state.store(WAITING, std::memory_order_relaxed);
+            slot.seq.store(ticket + 1);
+            notify();
+            return ticket;
+        }
+
+        // (client) waits for the server to release the commit and frees its slot
+        std::pair<timestamp_t, std::atomic<int> *> wait(uint64_t ticket)
+        {
+            auto &slot = at(ticket);
+            for (size_t i = 0; i < CLIENT_SPIN_COUNT && slot.state.load(std::memory_order_acquire) != RELEASED; i++)
+                std::this_thread::yield();
+            int state = WAITING;
+            while (state != RELEASED)
+            {
+                if (state == SLEEPING || slot.state.compare_exchange_strong(state, SLEEPING))
+                    futex_wait(slot.state, SLEEPING);
+                state = slot.state.load(std::memory_order_acquire);
+            }
+            std::pair<timestamp_t, std::atomic<int> *> ret{slot.epoch_id, slot.num_unfinished};
+            slot.seq.store(ticket + capacity, std::memory_order_release);
+            return ret;
+        }
+
+        // (server) the number of published commits at the front, at most max
+        size_t ready(size_t max) const
+        {
+            size_t num = 0;
+            while (num < max && at(head + num).seq.load(std::memory_order_acquire) == head + num + 1)
+                ++num;
+            return num;
+        }
+
+        uint64_t front() const { return head; }
+
+        // (server) the slots stay with the clients until they are released
+        void pop(size_t num) { head += num; }
+
+        Slot &at(uint64_t ticket) const { return slots[ticket & (capacity - 1)]; }
+
+        // (server) the slot may be reused by another client right after
+        void release(uint64_t ticket)
+        {
+            auto &slot = at(ticket);
+            if (slot.state.exchange(RELEASED) == SLEEPING)
+                futex_wake(slot.state);
+        }
+
+        // (server) sleeps until a commit is pushed, notify() is called or the
+        // timeout expires
+        template <class Rep, class Period> void wait_push(const std::chrono::duration<Rep, Period> &timeout)
+        {
+            server_state.store(SLEEPING);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!ready(1))
+                futex_wait(server_state, SLEEPING, timeout);
+            server_state.store(RUNNING);
+        }
+
+        void notify()
+        {
+            if (server_state.load() == SLEEPING && server_state.exchange(RUNNING) == SLEEPING)
+                futex_wake(server_state);
+        }
+
+    private:
+        const size_t capacity;
+        std::unique_ptr<Slot[]> slots;
+        uint64_t head; // (server) ticket of the first unserved commit
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<int> server_state;
+
+        constexpr static int RUNNING = 0;
+        constexpr static int WAITING = 0;
+        constexpr static int RELEASED = 1;
+        constexpr static int SLEEPING = 2;
+        constexpr static size_t CLIENT_SPIN_COUNT = 64;
+    };
+
+} // namespace livegraph
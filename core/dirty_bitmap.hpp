@@ -0,0 +1,96 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "allocator.hpp"
+#include "types.hpp"
+#include "vertex_array.hpp"
+
+namespace livegraph
+{
+    // The set of vertices which may have garbage, shared by all threads.
+    // A bit per vertex, and a summary bit per word of vertices, so marking
+    // is O(1) and draining skips clean ranges.
+    class DirtyBitmap
+    {
+    public:
+        DirtyBitmap(SparseArrayAllocator<void> allocator = SparseArrayAllocator<void>())
+            : words(allocator), summary(allocator), size(0)
+        {
+        }
+
+        DirtyBitmap(const DirtyBitmap &) = delete;
+
+        DirtyBitmap(DirtyBitmap &&) = delete;
+
+        // Ids below new_size may be marked once it returns.
+        void grow(vertex_t new_size)
+        {
+            words.grow(num_words(new_size));
+            summary.grow(num_words(num_words(new_size)));
+            vertex_t old_size = size.load();
+            while (old_size < new_size && !size.compare_exchange_weak(old_size, new_size))
+                ;
+        }
+
+        // Avoids dirtying the cache lines when the bits are set.
+        void mark(vertex_t vertex)
+        {
+            auto &word = words[vertex / WORD_BITS];
+            auto bit = 1ul << (vertex % WORD_BITS);
+            if (!(word.load() & bit))
+                word.fetch_or(bit);
+            auto &summary_word = summary[vertex / WORD_BITS / WORD_BITS];
+            auto summary_bit = 1ul << (vertex / WORD_BITS % WORD_BITS);
+            if (!(summary_word.load() & summary_bit))
+                summary_word.fetch_or(summary_bit);
+        }
+
+        // Returns the marked vertices in order, and clears them. A vertex
+        // marked meanwhile is returned by this or the next call.
+        std::vector<vertex_t> drain()
+        {
+            std::vector<vertex_t> vertices;
+            auto summary_size = num_words(num_words(size.load()));
+            for (size_t i = 0; i < summary_size; i++)
+            {
+                if (!summary[i].load(std::memory_order_relaxed))
+                    continue;
+                // cleared before the words, which are set before it
+                for (uint64_t s = summary[i].exchange(0); s; s &= s - 1)
+                {
+                    auto w = i * WORD_BITS + __builtin_ctzl(s);
+                    for (uint64_t bits = words[w].exchange(0); bits; bits &= bits - 1)
+                        vertices.push_back(w * WORD_BITS + __builtin_ctzl(bits));
+                }
+            }
+            return vertices;
+        }
+
+    private:
+        VertexArray<std::atomic<uint64_t>> words;
+        VertexArray<std::atomic<uint64_t>> summary;
+        std::atomic<vertex_t> size;
+
+        constexpr static size_t WORD_BITS = 64;
+
+        static size_t num_words(size_t num_bits) { return (num_bits + WORD_BITS - 1) / WORD_BITS; }
+    };
+} // namespace livegraph
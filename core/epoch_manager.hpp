@@ -0,0 +1,225 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <tbb/enumerable_thread_specific.h>
+
+#include "types.hpp"
+
+namespace livegraph
+{
+    // Tracks the read epochs of the running transactions, and frees blocks
+    // retired by compaction once no transaction can be on them. Both are
+    // kept per thread.
+    class EpochManager
+    {
+    public:
+        // Identifies a transaction of a thread between enter() and exit().
+        using Handle = uint64_t;
+
+        EpochManager(std::atomic<timestamp_t> &_global_epoch)
+            : global_epoch(_global_epoch),
+              slots(),
+              slots_mutex(),
+              listed_slots(),
+              scan_mutex(),
+              watermark(0),
+              scanned_epoch(NO_EPOCH),
+              next_scan_time(0)
+        {
+        }
+
+        EpochManager(const EpochManager &) = delete;
+
+        EpochManager(EpochManager &&) = delete;
+
+        // Returns the read epoch of a transaction of the calling thread, which
+        // may run several at once, and its handle.
+        std::pair<timestamp_t, Handle> enter()
+        {
+            auto &slot = local_slot();
+            auto read_epoch_id = global_epoch.load();
+            // published before a scan may read a later global epoch, unless an
+            // older transaction of the thread keeps the slot lower
+            while (true)
+            {
+                if (slot.read_epochs.empty())
+                    slot.epoch.store(read_epoch_id);
+                auto current_epoch_id = global_epoch.load();
+                if (current_epoch_id == read_epoch_id)
+                    break;
+                read_epoch_id = current_epoch_id;
+            }
+            auto handle = ++slot.num_entered;
+            slot.read_epochs.emplace_back(handle, read_epoch_id);
+            return {read_epoch_id, handle};
+        }
+
+        // Ends a transaction of the calling thread. NO_HANDLE, of transactions
+        // which did not enter, is ignored.
+        void exit(Handle handle)
+        {
+            if (handle == NO_HANDLE)
+                return;
+            auto &slot = local_slot();
+            auto iter = std::find_if(slot.read_epochs.begin(), slot.read_epochs.end(),
+                                     [&](const auto &entry) { return entry.first == handle; });
+            if (iter == slot.read_epochs.end())
+                return;
+            slot.read_epochs.erase(iter);
+            auto min_epoch_id = NO_EPOCH;
+            for (auto [_, read_epoch_id] : slot.read_epochs)
+            {
+                if (min_epoch_id == NO_EPOCH || read_epoch_id < min_epoch_id)
+                    min_epoch_id = read_epoch_id;
+            }
+            slot.epoch.store(min_epoch_id, std::memory_order_release);
+        }
+
+        // No running transaction has a smaller read epoch. The slots are only
+        // scanned when older transactions may have finished since the last
+        // scan, by one thread at a time.
+        timestamp_t low_watermark()
+        {
+            auto epoch_id = global_epoch.load();
+            auto cached = watermark.load();
+            if (cached == epoch_id)
+                return cached;
+            auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            if (scanned_epoch.load() == epoch_id && now < next_scan_time.load())
+                return cached;
+            std::unique_lock<std::mutex> lock(scan_mutex, std::try_to_lock);
+            if (!lock.owns_lock())
+                return cached;
+
+            auto min_epoch_id = epoch_id;
+            for_each_slot([&](Slot &slot) {
+                auto id = slot.epoch.load();
+                if (id != NO_EPOCH && id < min_epoch_id)
+                    min_epoch_id = id;
+            });
+            if (min_epoch_id > cached)
+                watermark.store(min_epoch_id);
+            scanned_epoch.store(epoch_id);
+            next_scan_time.store(now + std::chrono::nanoseconds(SCAN_INTERVAL).count());
+            return std::max(min_epoch_id, cached);
+        }
+
+        // The block is unlinked, but transactions may still be on it. The
+        // lock of the slot is only shared with reclaim().
+        void retire(uintptr_t pointer, order_t order)
+        {
+            auto &slot = local_slot();
+            std::lock_guard<std::mutex> lock(slot.retired_mutex);
+            slot.retired.push_back({global_epoch.load(), pointer, order});
+            slot.retired_size.fetch_add(1ul << order, std::memory_order_relaxed);
+        }
+
+        // Frees the blocks retired before the epoch reached the watermark,
+        // from the lists of all threads.
+        template <typename F> size_t reclaim(timestamp_t watermark_id, F free)
+        {
+            std::vector<RetiredBlock> blocks;
+            size_t size = 0;
+            for_each_slot([&](Slot &slot) {
+                blocks.clear();
+                {
+                    std::lock_guard<std::mutex> lock(slot.retired_mutex);
+                    while (!slot.retired.empty() && slot.retired.front().epoch_id < watermark_id)
+                    {
+                        blocks.push_back(slot.retired.front());
+                        slot.retired.pop_front();
+                    }
+                }
+                size_t slot_size = 0;
+                for (auto &block : blocks)
+                {
+                    free(block.pointer, block.order);
+                    slot_size += 1ul << block.order;
+                }
+                slot.retired_size.fetch_sub(slot_size, std::memory_order_relaxed);
+                size += slot_size;
+            });
+            return size;
+        }
+
+        size_t get_retired_size()
+        {
+            size_t size = 0;
+            for_each_slot([&](Slot &slot) { size += slot.retired_size.load(std::memory_order_relaxed); });
+            return size;
+        }
+
+        constexpr static timestamp_t NO_EPOCH = -1;
+        constexpr static Handle NO_HANDLE = 0;
+
+    private:
+        struct RetiredBlock
+        {
+            timestamp_t epoch_id; // when it was unlinked
+            uintptr_t pointer;
+            order_t order;
+        };
+
+        struct alignas(64) Slot
+        {
+            std::atomic<timestamp_t> epoch{NO_EPOCH};              // the smallest of read_epochs
+            std::vector<std::pair<Handle, timestamp_t>> read_epochs; // only used by the owner
+            Handle num_entered = NO_HANDLE;
+            std::mutex retired_mutex;
+            std::deque<RetiredBlock> retired; // in the order of their epochs
+            std::atomic<size_t> retired_size{0};
+            bool listed = false; // in listed_slots
+        };
+
+        std::atomic<timestamp_t> &global_epoch;
+        tbb::enumerable_thread_specific<Slot> slots; // padded, one per thread
+        std::mutex slots_mutex;
+        std::vector<Slot *> listed_slots; // the constructed slots, to be scanned
+        std::mutex scan_mutex;
+        std::atomic<timestamp_t> watermark;
+        std::atomic<timestamp_t> scanned_epoch;
+        std::atomic<int64_t> next_scan_time; // of the steady clock
+
+        constexpr static auto SCAN_INTERVAL = std::chrono::milliseconds(1);
+
+        Slot &local_slot()
+        {
+            auto &slot = slots.local();
+            if (__builtin_expect(!slot.listed, 0))
+            {
+                std::lock_guard<std::mutex> lock(slots_mutex);
+                listed_slots.push_back(&slot);
+                slot.listed = true;
+            }
+            return slot;
+        }
+
+        template <typename F> void for_each_slot(F f)
+        {
+            std::lock_guard<std::mutex> lock(slots_mutex);
+            for (auto slot : listed_slots)
+                f(*slot);
+        }
+    };
+} // namespace livegraph
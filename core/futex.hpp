@@ -15,7 +15,9 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <climits>
 #include <stdexcept>
 
 #include <errno.h>
@@ -25,6 +27,31 @@
 
 namespace livegraph
 {
+    // Sleeps while word is val, until woken up (maybe spuriously) or the
+    // timeout, if any, expires.
+    inline void futex_wait(std::atomic<int> &word, int val, const struct timespec *timeout = nullptr)
+    {
+        int ret = syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAIT_PRIVATE, val, timeout, nullptr, 0);
+        if (ret == -1 && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+            throw std::runtime_error("Futex wait error.");
+    }
+
+    template <class Rep, class Period>
+    inline void futex_wait(std::atomic<int> &word, int val, const std::chrono::duration<Rep, Period> &timeout_duration)
+    {
+        const struct timespec timeout = {.tv_sec = timeout_duration / std::chrono::seconds(1),
+                                         .tv_nsec = (timeout_duration % std::chrono::seconds(1)) /
+                                                    std::chrono::nanoseconds(1)};
+        futex_wait(word, val, &timeout);
+    }
+
+    inline void futex_wake(std::atomic<int> &word, int num = INT_MAX)
+    {
+        int ret = syscall(SYS_futex, reinterpret_cast<int *>(&word), FUTEX_WAKE_PRIVATE, num, nullptr, nullptr, 0);
+        if (ret == -1)
+            throw std::runtime_error("Futex wake error.");
+    }
+
     class Futex
     {
     public:
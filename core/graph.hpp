@@ -16,50 +16,100 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_set>
+#include <vector>
 
 #include <tbb/concurrent_queue.h>
 #include <tbb/enumerable_thread_specific.h>
 
 #include "allocator.hpp"
 #include "block_manager.hpp"
+#include "blocks.hpp"
 #include "commit_manager.hpp"
+#include "dirty_bitmap.hpp"
+#include "epoch_manager.hpp"
 #include "futex.hpp"
+#include "vertex_array.hpp"
 
 namespace livegraph
 {
     class EdgeIterator;
     class Transaction;
 
+    struct GraphStats
+    {
+        // of the allocated blocks by type, including old versions
+        size_t vertex_block_size;
+        size_t edge_block_size;
+        size_t edge_label_block_size;
+        size_t bloom_filter_size;  // in the edge blocks
+        size_t num_garbage_blocks; // old versions not yet freed by compaction
+        size_t garbage_size;       // of the old versions
+        size_t num_deleted_edges;  // deleted and still stored
+        size_t retired_size;       // of the blocks unlinked, and freed once no reader can be on them
+        BlockStats blocks;
+    };
+
+    struct CompactionOptions
+    {
+        size_t num_threads = 1;
+        size_t max_bytes_per_second = 0; // freed and copied by all threads, unlimited if 0
+        double garbage_ratio = 0.1;      // of old versions and deleted edges to allocated blocks, to start a pass
+        std::chrono::milliseconds interval = std::chrono::milliseconds(100); // between checks
+    };
+
     class Graph
     {
     public:
         Graph(std::string block_path = "",
               std::string wal_path = "",
               size_t _max_block_size = 1ul << 40,
-              vertex_t _max_vertex_id = 1ul << 40)
+              vertex_t _max_vertex_id = 1ul << 40,
+              Durability _durability = Durability::Sync,
+              size_t num_wal_streams = 1,
+              HugePages huge_pages = HugePages::None,
+              NumaPlacement _numa_placement = NumaPlacement::None,
+              std::string cold_block_path = "")
             : mutex(),
               epoch_id(0),
               transaction_id(0),
               vertex_id(0),
-              read_epoch_table(NO_TRANSACTION),
-              compact_table(),
+              epochs(epoch_id),
+              wal_buffers(),
               recycled_vertex_ids(),
               max_vertex_id(_max_vertex_id),
-              array_allocator(),
-              block_manager(block_path, _max_block_size),
-              commit_manager(wal_path, epoch_id)
+              durability(wal_path.empty() ? Durability::None : _durability),
+              checkpoint_path(wal_path.empty() ? "" : wal_path + "/checkpoint"),
+              numa_placement(_numa_placement),
+              is_follower(false),
+              following(false),
+              array_allocator(huge_pages),
+              block_manager(block_path,
+                            _max_block_size,
+                            huge_pages,
+                            numa_placement != NumaPlacement::None,
+                            cold_block_path),
+              commit_manager(wal_path, epoch_id, num_wal_streams),
+              vertex_futexes(array_allocator),
+              vertex_ptrs(array_allocator),
+              edge_label_ptrs(array_allocator),
+              vertex_accesses(block_manager.tiered()
+                                  ? std::make_unique<VertexArray<std::atomic<uint8_t>>>(array_allocator)
+                                  : nullptr),
+              dirty_vertices(array_allocator),
+              follower_thread(),
+              compactor_mutex(),
+              compactor(),
+              background_compaction(false),
+              stat_counters()
         {
-            auto futex_allocater =
-                std::allocator_traits<decltype(array_allocator)>::rebind_alloc<Futex>(array_allocator);
-            vertex_futexes = futex_allocater.allocate(max_vertex_id);
-
-            auto pointer_allocater =
-                std::allocator_traits<decltype(array_allocator)>::rebind_alloc<uintptr_t>(array_allocator);
-            vertex_ptrs = pointer_allocater.allocate(max_vertex_id);
-            edge_label_ptrs = pointer_allocater.allocate(max_vertex_id);
+            recover();
         }
 
         Graph(const Graph &) = delete;
@@ -68,24 +118,86 @@ namespace livegraph
 
         ~Graph() noexcept
         {
-            auto futex_allocater =
-                std::allocator_traits<decltype(array_allocator)>::rebind_alloc<Futex>(array_allocator);
-            futex_allocater.deallocate(vertex_futexes, max_vertex_id);
-
-            auto pointer_allocater =
-                std::allocator_traits<decltype(array_allocator)>::rebind_alloc<uintptr_t>(array_allocator);
-            pointer_allocater.deallocate(vertex_ptrs, max_vertex_id);
-            pointer_allocater.deallocate(edge_label_ptrs, max_vertex_id);
+            stop_compaction();
+            following.store(false);
+            if (follower_thread.joinable())
+                follower_thread.join();
+            if (block_manager.persistent() && !is_follower)
+            {
+                // no transaction is running
+                reclaim_blocks(ROLLBACK_TOMBSTONE);
+                save();
+            }
         }
 
         vertex_t get_max_vertex_id() const { return vertex_id; }
 
         timestamp_t compact(timestamp_t read_epoch_id = NO_TRANSACTION);
 
+        // Compacts the vertices written by all threads on TBB workers, or on
+        // num_threads of them. Vertices locked by writers are left for later.
+        timestamp_t compact_all(size_t num_threads = 0, timestamp_t read_epoch_id = NO_TRANSACTION);
+
+        // After compaction, free space of at least threshold bytes in whole
+        // chunks is released to the OS. Disabled by default.
+        void set_trim_threshold(size_t threshold) { block_manager.set_trim_threshold(threshold); }
+
+        // Compacts the vertices written by all threads on background threads,
+        // instead of the writers compacting their own every COMPACTION_CYCLE
+        // transactions. A pass starts when the garbage ratio is reached.
+        void start_compaction(CompactionOptions options = CompactionOptions());
+        void stop_compaction();
+
+        // The counters are summed without stopping writers, so a snapshot may
+        // be off by the operations in flight.
+        GraphStats stats();
+
+        // With a cold block path, moves the edge blocks of vertices whose
+        // edges were not read since the last pass to the cold tier, and those
+        // of vertices read again back. Old copies are freed by compaction, as
+        // for compacted blocks. The new cold blocks are written back and
+        // dropped from memory, and the free chunks trimmed. Returns the
+        // migrated bytes.
+        size_t migrate_blocks(timestamp_t read_epoch_id = NO_TRANSACTION);
+
+        // Writes the graph visible at the current epoch next to the WAL and
+        // releases the groups it covers. Writers are not blocked.
+        timestamp_t checkpoint();
+
+        // Transactions use the durability of the graph unless given one, which
+        // is Durability::None without a WAL.
         Transaction begin_transaction();
+        Transaction begin_transaction(Durability txn_durability);
         Transaction begin_read_only_transaction();
         Transaction begin_batch_loader();
 
+        // Turns an empty graph without a WAL into a read-only follower of the
+        // graph writing the WAL at primary_wal_path, which may be another
+        // process. Its checkpoint and groups are replayed, and new groups keep
+        // being replayed in the background; read-only transactions see the
+        // last replayed epoch. A primary with multiple WAL streams is not
+        // supported.
+        // Groups are replayed once written, before the primary flushes them,
+        // so a follower may show commits the primary loses in a crash.
+        void follow(std::string primary_wal_path);
+
+        // False once the follower has lost the WAL, e.g. the primary released
+        // segments that are not replayed yet.
+        bool is_following() const { return following.load(); }
+
+        // Delivers the logged transactions committed after the start epoch of
+        // the stream, in commit order. A consumer applying them to a snapshot
+        // skips the ones at or before the read epoch of the snapshot, which
+        // should be at least the start epoch. Transactions with
+        // Durability::None and batch loaders are not captured.
+        std::shared_ptr<ChangeStream> subscribe(size_t capacity = DEFAULT_CHANGE_STREAM_CAPACITY);
+
+        // Calls f(txn, vertex) for every vertex in parallel, on read-only
+        // transactions of one snapshot. Vertices are split into ranges owned
+        // by the NUMA nodes in turn; with NumaPlacement::Vertex, the ranges of
+        // a node are scanned by threads bound to its CPUs.
+        void partitioned_scan(std::function<void(Transaction &, vertex_t)> f);
+
     private:
         using cacheline_padding_t = char[64];
 
@@ -99,20 +211,134 @@ namespace livegraph
         std::atomic<vertex_t> vertex_id;
         cacheline_padding_t padding4;
 
-        tbb::enumerable_thread_specific<timestamp_t> read_epoch_table;
-        tbb::enumerable_thread_specific<std::unordered_set<vertex_t>> compact_table;
+        EpochManager epochs; // read epochs of the running transactions
+        tbb::enumerable_thread_specific<std::vector<std::string>> wal_buffers; // reused by transactions
 
         tbb::concurrent_queue<vertex_t> recycled_vertex_ids;
 
         const vertex_t max_vertex_id;
+        const Durability durability;
+        const std::string checkpoint_path;
+        const NumaPlacement numa_placement;
+        bool is_follower;
+        std::atomic<bool> following;
 
         SparseArrayAllocator<void> array_allocator;
         BlockManager block_manager;
         CommitManager commit_manager;
 
-        Futex *vertex_futexes;
-        uintptr_t *vertex_ptrs;
-        uintptr_t *edge_label_ptrs;
+        // sized for the vertices created so far, up to max_vertex_id
+        VertexArray<Futex> vertex_futexes;
+        VertexArray<uintptr_t> vertex_ptrs;
+        VertexArray<uintptr_t> edge_label_ptrs;
+        std::unique_ptr<VertexArray<std::atomic<uint8_t>>> vertex_accesses; // access bits of the tiers
+        DirtyBitmap dirty_vertices; // which may have garbage
+
+        std::thread follower_thread;
+
+        class Compactor;
+        std::mutex compactor_mutex;
+        std::shared_ptr<Compactor> compactor; // guarded by compactor_mutex
+        std::atomic<bool> background_compaction;
+
+        class Replayer;
+
+        void recover();
+        timestamp_t min_read_epoch(timestamp_t read_epoch_id);
+        void reclaim_blocks(timestamp_t read_epoch_id);
+        // Retires every block of a vertex whose id is reused.
+        void retire_vertex(vertex_t vid);
+        // The entries of an edge block deleted by committed transactions.
+        static int64_t count_deleted_entries(EdgeBlockHeader *edge_block);
+        // Counts the blocks of a vertex restored from the block file, and
+        // marks it dirty if it has garbage.
+        void count_vertex(vertex_t vid);
+        // Resumes the compaction of a large edge block in slices, between
+        // which writers can take the futex of the vertex. Writes to the block
+        // in between invalidate it.
+        struct EdgeCompactionCursor
+        {
+            label_t label;
+            uintptr_t pointer; // of the block being compacted
+            timestamp_t committed_time;
+            size_t num_entries;
+            size_t index;       // of the next entry
+            size_t data_offset; // of the next entry
+            size_t new_num_entries;
+            size_t new_data_length;
+            uintptr_t new_pointer; // allocated once the live entries are counted
+            order_t new_order;
+        };
+
+        // Called with the futex of the vertex held. Returns whether it has
+        // garbage left for a later pass. Large edge blocks are left to the
+        // cursors.
+        bool compact_vertex(vertex_t vid,
+                            timestamp_t read_epoch_id,
+                            size_t &compacted_size,
+                            std::vector<EdgeCompactionCursor> &cursors);
+        bool edge_cursor_valid(vertex_t vid, const EdgeCompactionCursor &cursor);
+        // Returns whether the cursor is finished, after at most
+        // COMPACT_SLICE_TIME.
+        bool compact_edge_slice(vertex_t vid,
+                                EdgeCompactionCursor &cursor,
+                                timestamp_t read_epoch_id,
+                                size_t &compacted_size);
+        void release_edge_cursor(EdgeCompactionCursor &cursor);
+        // Marks the vertex dirty again if it is locked or has garbage left.
+        void try_compact_vertex(vertex_t vid, timestamp_t read_epoch_id, size_t &compacted_size);
+        void save();
+        bool restore();
+
+        uintptr_t alloc_block(order_t order, vertex_t vertex)
+        {
+            return block_manager.alloc(order, numa_placement == NumaPlacement::Vertex ? vertex_node(vertex)
+                                                                                      : BlockManager::LOCAL_NODE);
+        }
+
+        void mark_dirty(vertex_t vertex) { dirty_vertices.mark(vertex); }
+
+        // Grows the vertex arrays before ids below num_vertices are used.
+        void grow_vertices(vertex_t num_vertices)
+        {
+            if (num_vertices > max_vertex_id)
+                throw std::invalid_argument("The vertex id exceeds max_vertex_id.");
+            vertex_futexes.grow(num_vertices);
+            vertex_ptrs.grow(num_vertices);
+            edge_label_ptrs.grow(num_vertices);
+            if (vertex_accesses)
+                vertex_accesses->grow(num_vertices);
+            dirty_vertices.grow(num_vertices);
+        }
+
+        size_t vertex_node(vertex_t vertex) const { return vertex / NUMA_VERTEX_RANGE % block_manager.num_nodes(); }
+
+        // Avoids dirtying the cache line when the bit is set.
+        void touch_vertex(vertex_t vertex)
+        {
+            if (vertex_accesses && !(*vertex_accesses)[vertex].load(std::memory_order_relaxed))
+                (*vertex_accesses)[vertex].store(1, std::memory_order_relaxed);
+        }
+
+        std::string acquire_wal_buffer()
+        {
+            auto &buffers = wal_buffers.local();
+            if (buffers.empty())
+                return std::string();
+            auto wal = std::move(buffers.back());
+            buffers.pop_back();
+            return wal;
+        }
+
+        void release_wal_buffer(std::string wal)
+        {
+            auto &buffers = wal_buffers.local();
+            if (buffers.size() < WAL_BUFFER_POOL_SIZE && wal.capacity() <= MAX_POOLED_WAL_BUFFER_SIZE)
+            {
+                wal.clear();
+                buffers.emplace_back(std::move(wal));
+            }
+        }
 
         constexpr static size_t COMPACTION_CYCLE = 1ul << 20;
         constexpr static timestamp_t ROLLBACK_TOMBSTONE = INT64_MAX;
@@ -121,6 +347,86 @@ namespace livegraph
         constexpr static vertex_t VERTEX_TOMBSTONE = UINT64_MAX;
         constexpr static auto TIMEOUT = std::chrono::milliseconds(1);
         constexpr static size_t COMPACT_EDGE_BLOCK_THRESHOLD = 5; // at least compact 20% edges
+        constexpr static size_t COMPACT_GRAIN_SIZE = 64;           // vertices per task of compact_all
+        constexpr static order_t INCREMENTAL_COMPACT_ORDER = 16;   // edge blocks compacted in slices
+        constexpr static auto COMPACT_SLICE_TIME = std::chrono::microseconds(200);
+        constexpr static size_t COMPACT_SLICE_CHECK = 256; // entries between checks of the time
+        constexpr static size_t RECOVERY_PARTITIONS = 1ul << 10;
+        constexpr static size_t RECOVERY_BATCH_SIZE = 1ul << 22; // operations replayed per round
+        constexpr static size_t CHECKPOINT_BUFFER_SIZE = 1ul << 20;
+        constexpr static auto FOLLOW_INTERVAL = std::chrono::milliseconds(1);
+        constexpr static auto FOLLOW_COMPACTION_INTERVAL = std::chrono::milliseconds(100); // when idle
+        constexpr static size_t DEFAULT_CHANGE_STREAM_CAPACITY = 1ul << 16; // transactions
+        constexpr static size_t WAL_BUFFER_POOL_SIZE = 4;                // per thread
+        constexpr static size_t MAX_POOLED_WAL_BUFFER_SIZE = 1ul << 20; // larger buffers are freed
+        constexpr static vertex_t NUMA_VERTEX_RANGE = 1ul << 12;
+        constexpr static size_t STAT_STRIPES = 64;
+
+        // striped over threads, which may go negative as a block can be
+        // freed by another thread
+        struct alignas(64) StatCounters
+        {
+            std::atomic<int64_t> vertex_block_size;
+            std::atomic<int64_t> edge_block_size;
+            std::atomic<int64_t> edge_label_block_size;
+            std::atomic<int64_t> bloom_filter_size;
+            std::atomic<int64_t> num_garbage_blocks;
+            std::atomic<int64_t> garbage_size;
+            std::atomic<int64_t> num_deleted_edges;
+        };
+        StatCounters stat_counters[STAT_STRIPES];
+
+        StatCounters &local_stat_counters()
+        {
+            static std::atomic<size_t> next_stripe(0);
+            thread_local size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % STAT_STRIPES;
+            return stat_counters[stripe];
+        }
+
+        // Counts a block once it is filled (sign 1) and before it is freed
+        // (sign -1). A block with a previous version makes that one garbage;
+        // blocks freed by compaction were garbage themselves.
+        void count_block(uintptr_t pointer, int64_t sign, bool garbage = false)
+        {
+            auto block = block_manager.convert<N2OBlockHeader>(pointer);
+            auto &counters = local_stat_counters();
+            int64_t size = sign * (int64_t)block->get_block_size();
+            switch (block->get_type())
+            {
+            case BlockHeader::Type::VERTEX:
+                counters.vertex_block_size.fetch_add(size, std::memory_order_relaxed);
+                break;
+            case BlockHeader::Type::EDGE:
+                counters.edge_block_size.fetch_add(size, std::memory_order_relaxed);
+                if (block->get_order() >= EdgeBlockHeader::BLOOM_FILTER_THRESHOLD)
+                    counters.bloom_filter_size.fetch_add(
+                        sign * (int64_t)(block->get_block_size() >> EdgeBlockHeader::BLOOM_FILTER_PORTION),
+                        std::memory_order_relaxed);
+                break;
+            case BlockHeader::Type::EDGE_LABEL:
+                counters.edge_label_block_size.fetch_add(size, std::memory_order_relaxed);
+                break;
+            default:
+                break;
+            }
+            if (garbage)
+            {
+                counters.num_garbage_blocks.fetch_add(sign, std::memory_order_relaxed);
+                counters.garbage_size.fetch_add(size, std::memory_order_relaxed);
+            }
+            else if (auto prev_block = block_manager.convert<N2OBlockHeader>(block->get_prev_pointer()))
+            {
+                counters.num_garbage_blocks.fetch_add(sign, std::memory_order_relaxed);
+                counters.garbage_size.fetch_add(sign * (int64_t)prev_block->get_block_size(),
+                                                std::memory_order_relaxed);
+            }
+        }
+
+        void count_deleted_edges(int64_t num_edges)
+        {
+            if (num_edges)
+                local_stat_counters().num_deleted_edges.fetch_add(num_edges, std::memory_order_relaxed);
+        }
 
         friend class EdgeIterator;
         friend class Transaction;
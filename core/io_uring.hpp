@@ -0,0 +1,170 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace livegraph
+{
+    // A minimal io_uring with one submitting and one completing thread.
+    // valid() is false when the kernel does not support it.
+    class IOUring
+    {
+    public:
+        IOUring(unsigned entries)
+            : ring_fd(EMPTY_FD), ring(MAP_FAILED), ring_size(0), sqes(nullptr), num_entries(0), num_unsubmitted(0)
+        {
+            io_uring_params params = {};
+            ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+            if (ring_fd < 0)
+            {
+                ring_fd = EMPTY_FD;
+                return;
+            }
+            if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+            {
+                close(ring_fd);
+                ring_fd = EMPTY_FD;
+                return;
+            }
+
+            ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                                 params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                        IORING_OFF_SQ_RING);
+            sqes = reinterpret_cast<io_uring_sqe *>(mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+                                                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                                                         IORING_OFF_SQES));
+            if (ring == MAP_FAILED || sqes == MAP_FAILED)
+                throw std::runtime_error("mmap io_uring error.");
+
+            auto base = reinterpret_cast<char *>(ring);
+            sq_tail = reinterpret_cast<uint32_t *>(base + params.sq_off.tail);
+            sq_mask = *reinterpret_cast<uint32_t *>(base + params.sq_off.ring_mask);
+            cq_head = reinterpret_cast<uint32_t *>(base + params.cq_off.head);
+            cq_tail = reinterpret_cast<uint32_t *>(base + params.cq_off.tail);
+            cq_mask = *reinterpret_cast<uint32_t *>(base + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+            num_entries = params.sq_entries;
+
+            // sqes are used in order, so the indirection array is the identity
+            auto array = reinterpret_cast<uint32_t *>(base + params.sq_off.array);
+            for (uint32_t i = 0; i < num_entries; i++)
+                array[i] = i;
+        }
+
+        IOUring(const IOUring &) = delete;
+
+        IOUring(IOUring &&) = delete;
+
+        ~IOUring()
+        {
+            if (ring_fd == EMPTY_FD)
+                return;
+            munmap(sqes, num_entries * sizeof(io_uring_sqe));
+            munmap(ring, ring_size);
+            close(ring_fd);
+        }
+
+        bool valid() const { return ring_fd != EMPTY_FD; }
+
+        size_t size() const { return num_entries; }
+
+        // The caller keeps at most size() operations in flight. The iovecs and
+        // the buffers they point to stay valid until completion.
+        void prepare_writev(int fd, const iovec *iovecs, unsigned num_iovecs, uint64_t offset, uint64_t user_data)
+        {
+            auto sqe = next_sqe(IORING_OP_WRITEV, fd, user_data);
+            sqe->addr = reinterpret_cast<uintptr_t>(iovecs);
+            sqe->len = num_iovecs;
+            sqe->off = offset;
+        }
+
+        // Only covers the writes completed before it is submitted.
+        void prepare_fdatasync(int fd, uint64_t user_data)
+        {
+            auto sqe = next_sqe(IORING_OP_FSYNC, fd, user_data);
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+
+        void submit()
+        {
+            __atomic_store_n(sq_tail, *sq_tail + num_unsubmitted, __ATOMIC_RELEASE);
+            while (num_unsubmitted)
+            {
+                int ret = syscall(__NR_io_uring_enter, ring_fd, num_unsubmitted, 0, 0, nullptr, 0);
+                if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                    throw std::runtime_error("submit io_uring error.");
+                if (ret > 0)
+                    num_unsubmitted -= ret;
+            }
+        }
+
+        // Waits for at least one completion and calls f(user_data, res) for
+        // every available one.
+        template <typename F> void wait(F f)
+        {
+            auto head = *cq_head;
+            while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            {
+                int ret = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (ret < 0 && errno != EINTR)
+                    throw std::runtime_error("wait io_uring error.");
+            }
+            for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++)
+            {
+                auto &cqe = cqes[head & cq_mask];
+                f(cqe.user_data, cqe.res);
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+
+    private:
+        int ring_fd;
+        void *ring;
+        size_t ring_size;
+        io_uring_sqe *sqes;
+        uint32_t num_entries;
+        uint32_t num_unsubmitted;
+        uint32_t *sq_tail;
+        uint32_t sq_mask;
+        uint32_t *cq_head;
+        uint32_t *cq_tail;
+        uint32_t cq_mask;
+        io_uring_cqe *cqes;
+
+        constexpr static int EMPTY_FD = -1;
+
+        io_uring_sqe *next_sqe(uint8_t opcode, int fd, uint64_t user_data)
+        {
+            auto sqe = &sqes[(*sq_tail + num_unsubmitted++) & sq_mask];
+            *sqe = {};
+            sqe->opcode = opcode;
+            sqe->fd = fd;
+            sqe->user_data = user_data;
+            return sqe;
+        }
+    };
+} // namespace livegraph
@@ -0,0 +1,123 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace livegraph
+{
+    // The online NUMA nodes, numbered from 0 in the order of their ids. A
+    // system without NUMA information has a single node with all CPUs.
+    struct NumaTopology
+    {
+        std::vector<int> node_ids;
+        std::vector<int> node_indices; // by node id, -1 if offline
+        std::vector<std::vector<int>> node_cpus;
+
+        size_t num_nodes() const { return node_ids.size(); }
+
+        // Parses a sysfs list like "0-3,8-11".
+        static std::vector<int> read_list(const std::string &path)
+        {
+            std::vector<int> list;
+            auto file = fopen(path.c_str(), "r");
+            if (!file)
+                return list;
+            int begin, end;
+            char separator;
+            while (fscanf(file, "%d", &begin) == 1)
+            {
+                end = begin;
+                if (fscanf(file, "%c", &separator) == 1 && separator == '-')
+                {
+                    if (fscanf(file, "%d", &end) != 1)
+                        break;
+                    if (fscanf(file, "%c", &separator) != 1)
+                        separator = '\n';
+                }
+                for (int i = begin; i <= end; i++)
+                    list.push_back(i);
+                if (separator != ',')
+                    break;
+            }
+            fclose(file);
+            return list;
+        }
+
+        NumaTopology() : node_ids(read_list("/sys/devices/system/node/online")), node_indices(), node_cpus()
+        {
+            if (node_ids.empty())
+                node_ids.push_back(0);
+            for (auto node_id : node_ids)
+            {
+                if ((size_t)node_id >= node_indices.size())
+                    node_indices.resize(node_id + 1, -1);
+                node_indices[node_id] = node_cpus.size();
+                node_cpus.emplace_back(
+                    read_list("/sys/devices/system/node/node" + std::to_string(node_id) + "/cpulist"));
+            }
+            if (node_ids.size() == 1 && node_cpus[0].empty())
+            {
+                for (int cpu = 0; cpu < (int)sysconf(_SC_NPROCESSORS_ONLN); cpu++)
+                    node_cpus[0].push_back(cpu);
+            }
+        }
+    };
+
+    inline const NumaTopology &numa_topology()
+    {
+        static const NumaTopology topology;
+        return topology;
+    }
+
+    // The node of the CPU running the caller, which may move.
+    inline size_t current_numa_node()
+    {
+        unsigned cpu, node_id;
+        auto &topology = numa_topology();
+        if (syscall(SYS_getcpu, &cpu, &node_id, nullptr) != 0 || node_id >= topology.node_indices.size() ||
+            topology.node_indices[node_id] < 0)
+            return 0;
+        return topology.node_indices[node_id];
+    }
+
+    // Prefers the node for the pages of a range, which falls back to other
+    // nodes when it runs out of memory.
+    inline bool prefer_numa_node(void *addr, size_t length, size_t node)
+    {
+        auto node_id = numa_topology().node_ids[node];
+        std::vector<unsigned long> mask(node_id / 64 + 1, 0);
+        mask[node_id / 64] |= 1ul << (node_id % 64);
+        return syscall(SYS_mbind, addr, length, MPOL_PREFERRED, mask.data(), mask.size() * 64 + 1, 0) == 0;
+    }
+
+    // Binds the calling thread to the CPUs of the node.
+    inline bool bind_numa_node(size_t node)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (auto cpu : numa_topology().node_cpus[node])
+            CPU_SET(cpu, &cpus);
+        return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+    }
+} // namespace livegraph
@@ -25,20 +25,12 @@
 #include "blocks.hpp"
 #include "graph.hpp"
 #include "utils.hpp"
+#include "wal.hpp"
 
 namespace livegraph
 {
     class Transaction
     {
-        enum class OPType
-        {
-            NewVertex,
-            PutVertex,
-            DelVertex,
-            PutEdge,
-            DelEdge,
-        };
-
     public:
         class RollbackExcept : public std::runtime_error
         {
@@ -47,16 +39,23 @@ namespace livegraph
             RollbackExcept(const char *what_arg) : std::runtime_error(what_arg) {}
         };
 
-        Transaction(
-            Graph &_graph, timestamp_t _local_txn_id, timestamp_t _read_epoch_id, bool _batch_update, bool _trace_cache)
+        Transaction(Graph &_graph,
+                    timestamp_t _local_txn_id,
+                    timestamp_t _read_epoch_id,
+                    bool _batch_update,
+                    bool _trace_cache,
+                    Durability _durability,
+                    EpochManager::Handle _epoch_handle = EpochManager::NO_HANDLE)
             : graph(_graph),
               local_txn_id(_local_txn_id),
               read_epoch_id(_read_epoch_id),
+              epoch_handle(_epoch_handle),
               batch_update(_batch_update),
               trace_cache(_trace_cache),
+              durability(_durability),
               write_epoch_id(batch_update ? read_epoch_id : -local_txn_id),
               valid(true),
-              wal(),
+              wal(durability == Durability::None ? std::string() : graph.acquire_wal_buffer()),
               vertex_ptr_cache(),
               edge_ptr_cache(),
               block_cache(),
@@ -64,11 +63,15 @@ namespace livegraph
               new_vertex_cache(),
               recycled_vertex_cache(),
               acquired_locks(),
-              timestamps_to_update()
+              timestamps_to_update(),
+              num_deleted_edges(0)
         {
-            wal_append((uint64_t)0); // number of operations
-            wal_append(read_epoch_id);
-            wal_append(local_txn_id);
+            if (durability != Durability::None)
+            {
+                wal_append((uint64_t)0); // number of operations
+                wal_append(read_epoch_id);
+                wal_append(local_txn_id);
+            }
         }
 
         Transaction(const Transaction &) = delete;
@@ -77,8 +80,10 @@ namespace livegraph
             : graph(txn.graph),
               local_txn_id(std::move(txn.local_txn_id)),
               read_epoch_id(std::move(txn.read_epoch_id)),
+              epoch_handle(std::move(txn.epoch_handle)),
               batch_update(std::move(txn.batch_update)),
               trace_cache(std::move(txn.trace_cache)),
+              durability(std::move(txn.durability)),
               write_epoch_id(std::move(txn.write_epoch_id)),
               valid(std::move(txn.valid)),
               wal(std::move(txn.wal)),
@@ -89,7 +94,8 @@ namespace livegraph
               new_vertex_cache(std::move(txn.new_vertex_cache)),
               recycled_vertex_cache(std::move(txn.recycled_vertex_cache)),
               acquired_locks(std::move(txn.acquired_locks)),
-              timestamps_to_update(std::move(txn.timestamps_to_update))
+              timestamps_to_update(std::move(txn.timestamps_to_update)),
+              num_deleted_edges(txn.num_deleted_edges)
         {
             txn.valid = false;
         }
@@ -106,6 +112,10 @@ namespace livegraph
         std::string_view get_vertex(vertex_t vertex_id);
         std::string_view get_edge(vertex_t src, label_t label, vertex_t dst);
         EdgeIterator get_edges(vertex_t src, label_t label, bool reverse = false);
+        // Same as get_edges for each pair, but the blocks of all pairs are
+        // prefetched level by level first, so their misses overlap.
+        std::vector<EdgeIterator> get_edges_batch(const std::vector<std::pair<vertex_t, label_t>> &edges,
+                                                  bool reverse = false);
 
         timestamp_t commit(bool wait_visable = true);
         void abort();
@@ -120,8 +130,10 @@ namespace livegraph
         Graph &graph;
         const timestamp_t local_txn_id;
         const timestamp_t read_epoch_id;
+        const EpochManager::Handle epoch_handle; // of a transaction entered into graph.epochs
         const bool batch_update;
         const bool trace_cache;
+        const Durability durability;
         const timestamp_t write_epoch_id;
         bool valid;
         std::string wal;
@@ -135,20 +147,29 @@ namespace livegraph
 
         std::unordered_set<vertex_t> acquired_locks;
         std::vector<std::pair<timestamp_t *, timestamp_t>> timestamps_to_update;
+        int64_t num_deleted_edges; // counted when committed
+
+        template <typename T> inline void wal_append(T data) { livegraph::wal_append(wal, data); }
 
-        template <typename T, typename = std::enable_if_t<std::is_trivial_v<T>>> inline void wal_append(T data)
+        inline uint64_t &wal_num_ops() { return *reinterpret_cast<uint64_t *>(wal.data()); }
+
+        template <typename... T> inline void wal_log(OPType type, T... data)
         {
-            wal.append(reinterpret_cast<char *>(&data), sizeof(T));
+            if (durability == Durability::None)
+                return;
+            ++wal_num_ops();
+            wal_append(type);
+            (wal_append(data), ...);
         }
 
-        inline void wal_append(std::string_view data)
+        void count_deleted_edges(int64_t num_edges)
         {
-            wal_append(data.size());
-            wal.append(data);
+            if (batch_update)
+                graph.count_deleted_edges(num_edges);
+            else
+                num_deleted_edges += num_edges;
         }
 
-        inline uint64_t &wal_num_ops() { return *reinterpret_cast<uint64_t *>(wal.data()); }
-
         void check_writable()
         {
             if (!batch_update && !trace_cache)
@@ -163,7 +184,7 @@ namespace livegraph
 
         void check_vertex_id(vertex_t vertex_id)
         {
-            if (vertex_id >= graph.vertex_id.load(std::memory_order_relaxed))
+            if (vertex_id >= graph.vertex_id.load(std::memory_order_acquire))
                 throw std::invalid_argument("The vertex id is invalid.");
         }
 
@@ -191,7 +212,9 @@ namespace livegraph
                 graph.vertex_futexes[vertex_id].unlock();
             }
             valid = false;
-            graph.read_epoch_table.local() = Graph::NO_TRANSACTION;
+            graph.epochs.exit(epoch_handle);
+            if (durability != Durability::None)
+                graph.release_wal_buffer(std::move(wal));
         }
 
         std::pair<size_t, size_t> get_num_entries_data_length_cache(EdgeBlockHeader *edge_block) const
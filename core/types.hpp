@@ -25,4 +25,33 @@ namespace livegraph
     using order_t = uint8_t;
     using timestamp_t = int64_t;
 
+    // Sync commits return after their WAL is flushed, Async commits after it
+    // is written (it is flushed within a bounded interval), and None commits
+    // are not logged at all.
+    enum class Durability
+    {
+        Sync,
+        Async,
+        None,
+    };
+
+    // Backing of the block region and vertex arrays: Transparent advises the
+    // kernel to use transparent huge pages, and Explicit maps anonymous
+    // memory from the hugetlb pool, or expects a block file on hugetlbfs.
+    enum class HugePages
+    {
+        None,
+        Transparent,
+        Explicit,
+    };
+
+    // Local allocates the blocks of a transaction on the NUMA node running
+    // it, and Vertex on the node owning the range of their vertex.
+    enum class NumaPlacement
+    {
+        None,
+        Local,
+        Vertex,
+    };
+
 } // namespace livegraph
@@ -0,0 +1,94 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+
+#include "allocator.hpp"
+#include "types.hpp"
+
+namespace livegraph
+{
+    // An array indexed by vertex ids that grows in chunks. Chunk k holds
+    // FIRST_CHUNK_SIZE << k elements, so the mapped size is at most twice
+    // the grown size. Chunks never move, so reads are lock-free. Elements
+    // start zeroed.
+    template <typename T> class VertexArray
+    {
+    public:
+        VertexArray(SparseArrayAllocator<void> _allocator = SparseArrayAllocator<void>())
+            : allocator(_allocator), mutex(), size(0), chunks()
+        {
+            for (auto &chunk : chunks)
+                chunk.store(nullptr, std::memory_order_relaxed);
+        }
+
+        VertexArray(const VertexArray &) = delete;
+
+        VertexArray(VertexArray &&) = delete;
+
+        ~VertexArray()
+        {
+            for (size_t k = 0; k < MAX_CHUNKS; k++)
+            {
+                if (auto chunk = chunks[k].load(std::memory_order_relaxed))
+                    allocator.deallocate(chunk, chunk_size(k));
+            }
+        }
+
+        // Only ids below the grown size may be accessed.
+        T &operator[](vertex_t index)
+        {
+            auto k = chunk_index(index);
+            return chunks[k].load(std::memory_order_acquire)[index - chunk_begin(k)];
+        }
+
+        // Ids below new_size become valid once it returns.
+        void grow(vertex_t new_size)
+        {
+            if (new_size <= size.load(std::memory_order_acquire))
+                return;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (new_size <= size.load(std::memory_order_relaxed))
+                return;
+            auto last = chunk_index(new_size - 1);
+            if (last >= MAX_CHUNKS)
+                throw std::invalid_argument("The vertex id is too large.");
+            for (size_t k = 0; k <= last; k++)
+            {
+                if (!chunks[k].load(std::memory_order_relaxed))
+                    chunks[k].store(allocator.allocate(chunk_size(k)), std::memory_order_release);
+            }
+            size.store(new_size, std::memory_order_release);
+        }
+
+    private:
+        SparseArrayAllocator<T> allocator;
+        std::mutex mutex;
+        std::atomic<vertex_t> size;
+
+        constexpr static vertex_t FIRST_CHUNK_SIZE = 1ul << 12;
+        constexpr static size_t MAX_CHUNKS = 48;
+
+        std::atomic<T *> chunks[MAX_CHUNKS];
+
+        static size_t chunk_index(vertex_t index) { return 63 - __builtin_clzl(index / FIRST_CHUNK_SIZE + 1); }
+        static vertex_t chunk_begin(size_t k) { return FIRST_CHUNK_SIZE * ((1ul << k) - 1); }
+        static vertex_t chunk_size(size_t k) { return FIRST_CHUNK_SIZE << k; }
+    };
+} // namespace livegraph
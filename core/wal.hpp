@@ -0,0 +1,233 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include <immintrin.h>
+
+#include "types.hpp"
+
+namespace livegraph
+{
+    enum class OPType
+    {
+        NewVertex,
+        PutVertex,
+        DelVertex,
+        PutEdge,
+        DelEdge,
+    };
+
+    // A group is written by CommitManager as one record:
+    // [WALGroupHeader][txn 0]...[txn num_txns-1]
+    // and every txn record is produced by Transaction::wal_append:
+    // [num_ops][read_epoch_id][local_txn_id][op 0]...[op num_ops-1]
+    // Recovery stops before a group whose previous logged epoch is lost, so
+    // the groups of all streams are recovered as a prefix of the epochs.
+    struct WALGroupHeader
+    {
+        timestamp_t epoch_id;
+        size_t num_txns;
+        size_t length;             // bytes of txn records following the header
+        uint64_t checksum;         // crc32c of txn records
+        timestamp_t prev_epoch_id; // of the last group before it in any stream
+    };
+
+    static_assert(sizeof(WALGroupHeader) == 40);
+
+    // Every WAL segment file starts with a header written when the segment
+    // becomes active, so recycled files with stale groups are recognized.
+    struct WALSegmentHeader
+    {
+        uint64_t magic;
+        uint64_t segment_id;
+        timestamp_t prev_epoch_id; // epoch of the last group before this segment
+        uint64_t checksum;         // crc32c of the fields above
+    };
+
+    static_assert(sizeof(WALSegmentHeader) == 32);
+
+    constexpr uint64_t WAL_SEGMENT_MAGIC = 0x544e454d47455357; // "WSEGMENT"
+
+    struct WALOperation
+    {
+        OPType type;
+        vertex_t src; // vertex_id of vertex operations
+        label_t label;
+        vertex_t dst;
+        bool flag; // recycle of DelVertex, force_insert of PutEdge
+        std::string_view data;
+    };
+
+    // A checkpoint is an image of the graph visible at epoch_id, written as
+    // [CheckpointHeader][op 0][op 1]...[recycled vertex ids] with only
+    // PutVertex and PutEdge operations. Recovery replays it and then the WAL
+    // groups after epoch_id.
+    struct CheckpointHeader
+    {
+        uint64_t magic;
+        timestamp_t epoch_id;
+        vertex_t num_vertices;
+        size_t num_recycled_vertices;
+        size_t length;     // bytes of operations following the header
+        uint64_t checksum; // crc32c of operations and recycled vertex ids
+    };
+
+    static_assert(sizeof(CheckpointHeader) == 48);
+
+    constexpr uint64_t CHECKPOINT_MAGIC = 0x544e504b43454843; // "CHECKPNT"
+
+    template <typename T, typename = std::enable_if_t<std::is_trivial_v<T>>>
+    inline void wal_append(std::string &wal, T data)
+    {
+        wal.append(reinterpret_cast<char *>(&data), sizeof(T));
+    }
+
+    inline void wal_append(std::string &wal, std::string_view data)
+    {
+        wal_append(wal, data.size());
+        wal.append(data);
+    }
+
+    // A non-zero seed keeps zero-filled (preallocated) space from matching a
+    // zero checksum.
+    constexpr uint64_t WAL_CHECKSUM_SEED = 0xffffffff;
+
+    inline uint64_t wal_checksum(std::string_view data, uint64_t crc = WAL_CHECKSUM_SEED)
+    {
+        auto p = data.data();
+        auto size = data.size();
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), p += sizeof(uint64_t))
+        {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            crc = _mm_crc32_u64(crc, word);
+        }
+        for (; size; size--, p++)
+            crc = _mm_crc32_u8(crc, *p);
+        return crc;
+    }
+
+    inline uint64_t wal_segment_checksum(const WALSegmentHeader &header)
+    {
+        return wal_checksum(
+            std::string_view(reinterpret_cast<const char *>(&header), offsetof(WALSegmentHeader, checksum)));
+    }
+
+    inline bool check_wal_segment(const WALSegmentHeader &header, uint64_t segment_id)
+    {
+        return header.magic == WAL_SEGMENT_MAGIC && header.segment_id == segment_id &&
+               header.checksum == wal_segment_checksum(header);
+    }
+
+    // Returns the length of the valid group at the beginning of log, or 0 if
+    // the group is torn, corrupted or not after prev_epoch_id. Epochs without
+    // logged transactions leave gaps between groups.
+    inline size_t check_wal_group(std::string_view log, timestamp_t prev_epoch_id, WALGroupHeader &header)
+    {
+        if (log.size() < sizeof(WALGroupHeader))
+            return 0;
+        memcpy(&header, log.data(), sizeof(header));
+        if (header.epoch_id <= prev_epoch_id || header.prev_epoch_id >= header.epoch_id || header.num_txns == 0 ||
+            header.length > log.size() - sizeof(WALGroupHeader))
+            return 0;
+        if (wal_checksum(log.substr(sizeof(WALGroupHeader), header.length)) != header.checksum)
+            return 0;
+        return sizeof(WALGroupHeader) + header.length;
+    }
+
+    class WALReader
+    {
+    public:
+        WALReader(std::string_view _log) : log(_log), offset(0) {}
+
+        bool empty() const { return offset == log.size(); }
+
+        template <typename T, typename = std::enable_if_t<std::is_trivial_v<T>>> T read()
+        {
+            T data;
+            if (log.size() - offset < sizeof(T))
+                throw std::runtime_error("read wal error.");
+            memcpy(&data, log.data() + offset, sizeof(T));
+            offset += sizeof(T);
+            return data;
+        }
+
+        std::string_view read_data()
+        {
+            auto size = read<size_t>();
+            if (log.size() - offset < size)
+                throw std::runtime_error("read wal error.");
+            auto data = log.substr(offset, size);
+            offset += size;
+            return data;
+        }
+
+        WALOperation read_operation()
+        {
+            WALOperation op{read<OPType>(), 0, 0, 0, false, std::string_view()};
+            switch (op.type)
+            {
+            case OPType::NewVertex:
+                op.src = read<vertex_t>();
+                break;
+            case OPType::PutVertex:
+                op.src = read<vertex_t>();
+                op.data = read_data();
+                break;
+            case OPType::DelVertex:
+                op.src = read<vertex_t>();
+                op.flag = read<bool>();
+                break;
+            case OPType::PutEdge:
+                op.src = read<vertex_t>();
+                op.label = read<label_t>();
+                op.dst = read<vertex_t>();
+                op.flag = read<bool>();
+                op.data = read_data();
+                break;
+            case OPType::DelEdge:
+                op.src = read<vertex_t>();
+                op.label = read<label_t>();
+                op.dst = read<vertex_t>();
+                break;
+            default:
+                throw std::runtime_error("read wal error.");
+            }
+            return op;
+        }
+
+        template <typename F> void read_transaction(F f)
+        {
+            auto num_ops = read<uint64_t>();
+            read<timestamp_t>(); // read_epoch_id
+            read<timestamp_t>(); // local_txn_id
+            for (uint64_t i = 0; i < num_ops; i++)
+                f(read_operation());
+        }
+
+    private:
+        std::string_view log;
+        size_t offset;
+    };
+
+} // namespace livegraph
@@ -0,0 +1,900 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "change_stream.hpp"
+#include "commit_queue.hpp"
+#include "io_uring.hpp"
+#include "types.hpp"
+#include "wal.hpp"
+
+namespace livegraph
+{
+    inline std::string wal_segment_path(const std::string &path, uint64_t id)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016lx.wal", id);
+        return path + name;
+    }
+
+    // The ids of the segments in a WAL directory, in order.
+    inline std::vector<uint64_t> list_wal_segments(const std::string &path)
+    {
+        std::vector<uint64_t> ids;
+        auto dir = opendir(path.c_str());
+        if (!dir)
+            throw std::runtime_error("open wal directory error.");
+        while (auto entry = readdir(dir))
+        {
+            std::string_view name(entry->d_name);
+            if (name.size() == 20 && name.substr(16) == ".wal")
+                ids.emplace_back(std::stoul(std::string(name.substr(0, 16)), nullptr, 16));
+        }
+        closedir(dir);
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    // Assigns epochs to the groups of all WAL streams, and makes them
+    // visible in order once all their transactions are finished, together
+    // with the captured changes. Epochs are durable in order too, once the
+    // streams have flushed their groups.
+    class EpochSequencer
+    {
+    public:
+        EpochSequencer(std::atomic<timestamp_t> &_global_epoch_id)
+            : mutex(),
+              global_epoch_id(_global_epoch_id),
+              writing_epoch_id(_global_epoch_id),
+              logged_epoch_id(_global_epoch_id),
+              unfinished_epoch_id(),
+              durable_epoch_id(_global_epoch_id.load()),
+              sync_epoch_id(_global_epoch_id.load()),
+              flushed_epochs(),
+              changes()
+        {
+        }
+
+        // Called before any commit.
+        void reset(timestamp_t epoch_id)
+        {
+            writing_epoch_id = logged_epoch_id = epoch_id;
+            durable_epoch_id = sync_epoch_id = epoch_id;
+        }
+
+        // The counter starts with a reference held by the group until its
+        // transactions are released, or by a transaction committed without a
+        // group until it finishes. Epochs not logged are durable at once.
+        // A logged epoch also gets the previous one, in prev_logged_epoch_id.
+        std::pair<timestamp_t, std::atomic<int> *> next_epoch(bool logged,
+                                                              timestamp_t *prev_logged_epoch_id = nullptr)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto &[epoch_id, num_unfinished] = unfinished_epoch_id.emplace(++writing_epoch_id, 1);
+            flushed_epochs.emplace_back(!logged);
+            advance_durable();
+            if (logged)
+            {
+                if (prev_logged_epoch_id)
+                    *prev_logged_epoch_id = logged_epoch_id;
+                logged_epoch_id = epoch_id;
+            }
+            return {epoch_id, &num_unfinished};
+        }
+
+        // (stream) the groups of epochs are flushed
+        void flush(const std::vector<timestamp_t> &epochs)
+        {
+            if (epochs.empty())
+                return;
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto epoch_id : epochs)
+                flushed_epochs[epoch_id - durable_epoch_id.load(std::memory_order_relaxed) - 1] = true;
+            advance_durable();
+        }
+
+        // Waits until the groups of all streams up to epoch_id are flushed,
+        // and asks the streams behind to flush them now.
+        void wait_durable(timestamp_t epoch_id)
+        {
+            auto requested_epoch_id = sync_epoch_id.load();
+            while (requested_epoch_id < epoch_id && !sync_epoch_id.compare_exchange_weak(requested_epoch_id, epoch_id))
+                ;
+            while (durable_epoch_id.load() < epoch_id)
+                std::this_thread::yield();
+        }
+
+        // (stream) whether a transaction waits for the group of epoch_id
+        bool sync_requested(timestamp_t epoch_id) const { return sync_epoch_id.load() >= epoch_id; }
+
+        void advance()
+        {
+            std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+            if (!lock.owns_lock())
+                return;
+            while (!unfinished_epoch_id.empty())
+            {
+                auto &[current_epoch_id, num_unfinished] = unfinished_epoch_id.front();
+                if (num_unfinished.load() == 0)
+                {
+                    global_epoch_id = current_epoch_id;
+                    changes.publish(current_epoch_id);
+                    unfinished_epoch_id.pop();
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+
+        // The stream starts after the last assigned epoch.
+        std::shared_ptr<ChangeStream> subscribe(size_t capacity)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto stream = std::make_shared<ChangeStream>(capacity, writing_epoch_id);
+            changes.subscribe(stream);
+            return stream;
+        }
+
+        bool capturing() const { return changes.active(); }
+
+        // (server) the txn records of a group, before its epoch is finished
+        void capture(timestamp_t epoch_id, const std::vector<std::string_view> &txns)
+        {
+            changes.stage(epoch_id, txns);
+        }
+
+    private:
+        std::mutex mutex;
+        std::atomic<timestamp_t> &global_epoch_id;
+        timestamp_t writing_epoch_id;
+        timestamp_t logged_epoch_id; // of the last group of any stream
+        std::queue<std::pair<timestamp_t, std::atomic<int>>> unfinished_epoch_id;
+        std::atomic<timestamp_t> durable_epoch_id;
+        std::atomic<timestamp_t> sync_epoch_id; // the latest epoch waited for
+        std::deque<bool> flushed_epochs;         // after durable_epoch_id
+        ChangeHub changes;
+
+        void advance_durable()
+        {
+            auto epoch_id = durable_epoch_id.load(std::memory_order_relaxed);
+            while (!flushed_epochs.empty() && flushed_epochs.front())
+            {
+                flushed_epochs.pop_front();
+                ++epoch_id;
+            }
+            durable_epoch_id.store(epoch_id);
+        }
+    };
+
+    class WALStream
+    {
+    public:
+        // A stream is a directory of fixed-size segments, preallocated (or
+        // recycled) by a helper thread, so that the server thread only rotates
+        // to a ready segment and never extends a file.
+        // Groups are gathered from the wal buffers of their transactions, which
+        // are not copied since their clients wait until the group is flushed.
+        // With io_uring, the server thread submits the write of a group and
+        // goes on to the next group, while a completion thread flushes the
+        // written groups with one fdatasync at a time and releases their
+        // clients in commit order.
+        WALStream(std::string _path, EpochSequencer &_sequencer, size_t _segment_size, bool use_io_uring)
+            : path(_path),
+              segment_size(_segment_size),
+              sequencer(_sequencer),
+              fd(EMPTY_FD),
+              segment_id(0),
+              segment_used_size(0),
+              segment_last_epoch_id(0),
+              unsynced_epochs(),
+              last_sync_time(),
+              segment_mutex(),
+              cv_segment(),
+              next_segment_id(1),
+              spare_segments(),
+              recycled_segments(),
+              closed_segments(),
+              writing_epoch_id(0),
+              group_wals(),
+              group_sync_tickets(),
+              group_iovecs(),
+              group_tail(),
+              mappings(),
+              scanned_groups(),
+              commits(COMMIT_QUEUE_SIZE),
+              closed(false),
+              ring(use_io_uring && !path.empty() ? 2 * MAX_INFLIGHT_GROUPS : 0),
+              inflight_mutex(),
+              cv_inflight(),
+              inflight_groups(),
+              fsync_inflight(false),
+              completion_closed(false),
+              server_thread([&] { server_loop(); }),
+              segment_thread(),
+              completion_thread()
+        {
+            if (!path.empty())
+            {
+                if (mkdir(path.c_str(), 0750) != 0 && errno != EEXIST)
+                    throw std::runtime_error("mkdir wal directory error.");
+            }
+            if (ring.valid())
+                completion_thread = std::thread([&] { completion_loop(); });
+        }
+
+        WALStream(const WALStream &) = delete;
+
+        WALStream(WALStream &&) = delete;
+
+        ~WALStream()
+        {
+            closed.store(true);
+            commits.notify();
+            server_thread.join();
+            if (completion_thread.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(inflight_mutex);
+                    completion_closed = true;
+                }
+                cv_inflight.notify_all();
+                completion_thread.join();
+            }
+            cv_segment.notify_all();
+            if (segment_thread.joinable())
+                segment_thread.join();
+            if (fd != EMPTY_FD)
+                close(fd);
+            for (auto [id, spare_fd] : spare_segments)
+                close(spare_fd);
+            for (auto mapping : mappings)
+                munmap(const_cast<char *>(mapping.data()), mapping.size());
+        }
+
+        // Appends the valid groups after begin_epoch_id to groups in commit
+        // order. They stay mapped until finish_recovery().
+        void scan(timestamp_t begin_epoch_id, std::vector<std::pair<WALGroupHeader, std::string_view>> &groups)
+        {
+            timestamp_t recovered_epoch_id = begin_epoch_id;
+            segment_last_epoch_id = recovered_epoch_id;
+            if (path.empty())
+                return;
+
+            auto ids = list_wal_segments(path);
+            size_t next = 0;
+            for (; next < ids.size(); next++)
+            {
+                auto id = ids[next];
+                int segment_fd = open(segment_path(id).c_str(), O_RDWR);
+                if (segment_fd == EMPTY_FD)
+                    throw std::runtime_error("open wal file error.");
+                struct stat st;
+                if (fstat(segment_fd, &st) != 0)
+                    throw std::runtime_error("stat wal file error.");
+                size_t size = st.st_size;
+
+                WALSegmentHeader header;
+                bool readable =
+                    size >= sizeof(header) && pread(segment_fd, &header, sizeof(header), 0) == sizeof(header);
+                // spares never rotated to, and dropped segments
+                if (readable && header.magic == 0)
+                {
+                    close(segment_fd);
+                    recycled_segments.emplace_back(segment_path(id));
+                    continue;
+                }
+                if (!readable || !check_wal_segment(header, id) || header.prev_epoch_id > recovered_epoch_id)
+                {
+                    close(segment_fd);
+                    break;
+                }
+
+                auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, segment_fd, 0);
+                if (data == MAP_FAILED)
+                    throw std::runtime_error("mmap wal file error.");
+                madvise(data, size, MADV_SEQUENTIAL);
+                std::string_view segment(reinterpret_cast<char *>(data), size);
+                mappings.emplace_back(segment);
+
+                auto prev_epoch_id = header.prev_epoch_id;
+                size_t offset = sizeof(header);
+                WALGroupHeader group_header;
+                size_t length;
+                while ((length = check_wal_group(segment.substr(offset), prev_epoch_id, group_header)))
+                {
+                    if (group_header.epoch_id > recovered_epoch_id)
+                    {
+                        groups.emplace_back(group_header,
+                                            segment.substr(offset + sizeof(group_header), group_header.length));
+                        scanned_groups.push_back({group_header.epoch_id, id, offset, prev_epoch_id});
+                        recovered_epoch_id = group_header.epoch_id;
+                    }
+                    prev_epoch_id = group_header.epoch_id;
+                    offset += length;
+                }
+
+                if (fd != EMPTY_FD)
+                {
+                    close(fd);
+                    closed_segments.emplace_back(segment_id, segment_last_epoch_id);
+                }
+                fd = segment_fd;
+                segment_id = id;
+                segment_used_size = offset;
+                segment_last_epoch_id = prev_epoch_id;
+            }
+
+            // drop the torn tail, if any, of the active segment
+            if (fd != EMPTY_FD && segment_used_size < segment_size)
+                fallocate(fd, FALLOC_FL_ZERO_RANGE, segment_used_size, segment_size - segment_used_size);
+
+            // the segments after a lost group must not be recovered later,
+            // even if a crash interrupts this
+            for (size_t i = ids.size(); i-- > next;)
+            {
+                int segment_fd = open(segment_path(ids[i]).c_str(), O_RDWR);
+                if (segment_fd == EMPTY_FD)
+                    throw std::runtime_error("open wal file error.");
+                clear_segment_header(segment_fd);
+                close(segment_fd);
+                recycled_segments.emplace_back(segment_path(ids[i]));
+            }
+            if (!ids.empty())
+                next_segment_id = ids.back() + 1;
+        }
+
+        // Continues the stream after its last group up to epoch_id. Later
+        // groups follow an epoch lost in another stream, and are dropped.
+        void finish_recovery(timestamp_t epoch_id)
+        {
+            for (auto mapping : mappings)
+                munmap(const_cast<char *>(mapping.data()), mapping.size());
+            mappings.clear();
+            auto dropped = std::find_if(scanned_groups.begin(), scanned_groups.end(),
+                                        [&](const ScannedGroup &group) { return group.epoch_id > epoch_id; });
+            if (dropped != scanned_groups.end())
+                drop_groups(*dropped);
+            scanned_groups.clear();
+            if (!path.empty())
+                segment_thread = std::thread([&] { segment_loop(); });
+        }
+
+        // Releases the segments whose groups are all covered by a checkpoint
+        // at epoch_id. They are recycled as future segments or deleted.
+        void truncate(timestamp_t epoch_id)
+        {
+            std::lock_guard<std::mutex> lock(segment_mutex);
+            while (!closed_segments.empty() && closed_segments.front().second <= epoch_id)
+            {
+                auto old_path = segment_path(closed_segments.front().first);
+                closed_segments.pop_front();
+                if (recycled_segments.size() < MAX_RECYCLED_SEGMENTS)
+                    recycled_segments.emplace_back(old_path);
+                else
+                    unlink(old_path.c_str());
+            }
+        }
+
+        // Only logged transactions are committed through a stream. Async ones
+        // are released once their group is written, and Sync ones once it is
+        // flushed.
+        std::pair<timestamp_t, std::atomic<int> *> register_commit(std::string_view wal, Durability durability)
+        {
+            return commits.wait(commits.push(wal, durability));
+        }
+
+    private:
+        struct ScannedGroup
+        {
+            timestamp_t epoch_id;
+            uint64_t segment_id;
+            size_t offset;
+            timestamp_t prev_epoch_id; // of the group before it in the stream
+        };
+
+        struct InflightGroup
+        {
+            WALGroupHeader header;
+            std::vector<iovec> iovecs; // header and wal buffers of the txns
+            std::string tail;          // wal buffers beyond WAL_MAX_IOVECS
+            int fd;
+            uint64_t first_ticket;
+            size_t num_txns;
+            std::vector<uint64_t> sync_tickets; // released once flushed
+            std::atomic<int> *num_unfinished;
+            bool written;
+            bool released; // the other txns are released once written
+            bool sync;     // waits for an fdatasync after it is written
+            bool syncing;  // covered by the inflight fdatasync
+            std::vector<timestamp_t> synced_epochs; // of the groups flushed with it
+        };
+
+        const std::string path;
+        const size_t segment_size;
+        EpochSequencer &sequencer;
+        int fd; // active segment
+        uint64_t segment_id;
+        size_t segment_used_size;
+        timestamp_t segment_last_epoch_id;
+        std::vector<timestamp_t> unsynced_epochs; // (server) of the groups written to the segment, not flushed yet
+        std::chrono::steady_clock::time_point last_sync_time;
+        std::mutex segment_mutex;                            // protect the segment lists below
+        std::condition_variable cv_segment;                  // (server/helper) wait for spare segments
+        uint64_t next_segment_id;                            // (helper) id of the next spare segment
+        std::deque<std::pair<uint64_t, int>> spare_segments; // (helper) preallocated segments, id and fd
+        std::vector<std::string> recycled_segments;          // released segments to reuse
+        std::deque<std::pair<uint64_t, timestamp_t>> closed_segments; // (server) full segments and last epochs
+        timestamp_t writing_epoch_id;            // (server) epoch of the last group
+        std::vector<std::string_view> group_wals; // (server) wal buffers of the logged txns of a group
+        std::vector<uint64_t> group_sync_tickets; // (server) Sync txns of a group, in order
+        std::vector<iovec> group_iovecs;         // (server) reused without io_uring
+        std::string group_tail;                  // (server) reused without io_uring
+        std::vector<std::string_view> mappings; // segments mapped during recovery
+        std::vector<ScannedGroup> scanned_groups; // found during recovery, in order
+        CommitQueue commits;
+        std::atomic<bool> closed;
+        IOUring ring; // invalid without io_uring, then groups are written synchronously
+        std::mutex inflight_mutex;
+        std::condition_variable cv_inflight;        // (server/completion) wait for inflight groups
+        std::deque<InflightGroup> inflight_groups; // (server) submitted groups in commit order
+        bool fsync_inflight;                       // (completion) at most one fdatasync is submitted
+        bool completion_closed;
+        std::thread server_thread;
+        std::thread segment_thread;
+        std::thread completion_thread;
+
+        constexpr static size_t NUM_SPARE_SEGMENTS = 2;
+        constexpr static size_t MAX_RECYCLED_SEGMENTS = 4;
+        constexpr static int EMPTY_FD = -1;
+        constexpr static auto SERVER_SPIN_INTERVAL = std::chrono::microseconds(100);
+        constexpr static auto ASYNC_FLUSH_INTERVAL = std::chrono::milliseconds(10);
+        constexpr static size_t MAX_INFLIGHT_GROUPS = 8;
+        constexpr static size_t COMMIT_QUEUE_SIZE = 1ul << 12;
+        constexpr static size_t MAX_GROUP_TXNS = COMMIT_QUEUE_SIZE / 2;
+        constexpr static uint64_t FSYNC_USER_DATA = 0; // writes use their group as user_data
+        constexpr static size_t WAL_MAX_IOVECS = IOV_MAX;
+
+        std::string segment_path(uint64_t id) const { return wal_segment_path(path, id); }
+
+        // (helper) keeps NUM_SPARE_SEGMENTS segments ready for rotation
+        void segment_loop()
+        {
+            std::unique_lock<std::mutex> lock(segment_mutex);
+            while (true)
+            {
+                cv_segment.wait(lock, [&]() { return closed.load() || spare_segments.size() < NUM_SPARE_SEGMENTS; });
+                if (closed.load())
+                    break;
+
+                auto id = next_segment_id++;
+                std::string recycled_path;
+                if (!recycled_segments.empty())
+                {
+                    recycled_path = recycled_segments.back();
+                    recycled_segments.pop_back();
+                }
+                lock.unlock();
+
+                auto new_path = segment_path(id);
+                if (!recycled_path.empty() && rename(recycled_path.c_str(), new_path.c_str()) != 0)
+                    throw std::runtime_error("rename wal file error.");
+                int spare_fd = open(new_path.c_str(), O_RDWR | O_CREAT, 0640);
+                if (spare_fd == EMPTY_FD)
+                    throw std::runtime_error("open wal file error.");
+                if (fallocate(spare_fd, 0, 0, segment_size) != 0 && ftruncate(spare_fd, segment_size) != 0)
+                    throw std::runtime_error("fallocate wal file error.");
+                WALSegmentHeader empty_header{};
+                if (pwrite(spare_fd, &empty_header, sizeof(empty_header), 0) != sizeof(empty_header))
+                    throw std::runtime_error("write wal file error.");
+                int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+                if (dir_fd != EMPTY_FD)
+                {
+                    fsync(dir_fd);
+                    close(dir_fd);
+                }
+
+                lock.lock();
+                spare_segments.emplace_back(id, spare_fd);
+                cv_segment.notify_all();
+            }
+        }
+
+        // Durably invalidates a segment, before it is recycled.
+        static void clear_segment_header(int segment_fd)
+        {
+            WALSegmentHeader empty_header{};
+            if (pwrite(segment_fd, &empty_header, sizeof(empty_header), 0) != sizeof(empty_header) ||
+                fdatasync(segment_fd) != 0)
+                throw std::runtime_error("write wal file error.");
+        }
+
+        // Truncates the stream before a scanned group, durably, so that the
+        // dropped groups are not recovered after the new ones. The segments
+        // after it get an empty header and are recycled.
+        void drop_groups(const ScannedGroup &group)
+        {
+            while (segment_id != group.segment_id)
+            {
+                clear_segment_header(fd);
+                close(fd);
+                recycled_segments.emplace_back(segment_path(segment_id));
+                segment_id = closed_segments.back().first;
+                closed_segments.pop_back();
+                fd = open(segment_path(segment_id).c_str(), O_RDWR);
+                if (fd == EMPTY_FD)
+                    throw std::runtime_error("open wal file error.");
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0)
+                throw std::runtime_error("stat wal file error.");
+            size_t tail_size = (size_t)st.st_size > group.offset ? st.st_size - group.offset : 0;
+            if (tail_size && fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, group.offset, tail_size) != 0)
+            {
+                std::string zeros(tail_size, '\0');
+                if (pwrite(fd, zeros.data(), zeros.size(), group.offset) != (ssize_t)zeros.size())
+                    throw std::runtime_error("write wal file error.");
+            }
+            if (fdatasync(fd) != 0)
+                throw std::runtime_error("fdatasync wal file error.");
+            segment_used_size = group.offset;
+            segment_last_epoch_id = group.prev_epoch_id;
+        }
+
+        // (server) flushes the groups written to the active segment
+        void sync_segment()
+        {
+            if (fdatasync(fd) != 0)
+                throw std::runtime_error("fdatasync wal file error.");
+            sequencer.flush(unsynced_epochs);
+            unsynced_epochs.clear();
+            last_sync_time = std::chrono::steady_clock::now();
+        }
+
+        // Groups of Async transactions are flushed after an interval, or once
+        // a Sync transaction of another stream waits for them.
+        bool sync_due() const
+        {
+            return !unsynced_epochs.empty() &&
+                   (std::chrono::steady_clock::now() - last_sync_time >= ASYNC_FLUSH_INTERVAL ||
+                    sequencer.sync_requested(unsynced_epochs.front()));
+        }
+
+        // (server) switches to a spare segment that can hold a group of size
+        void rotate_segment(size_t size)
+        {
+            wait_inflight_groups();
+            if (!unsynced_epochs.empty())
+                sync_segment();
+            std::unique_lock<std::mutex> lock(segment_mutex);
+            if (fd != EMPTY_FD)
+            {
+                close(fd);
+                closed_segments.emplace_back(segment_id, segment_last_epoch_id);
+            }
+            cv_segment.wait(lock, [&]() { return !spare_segments.empty(); });
+            std::tie(segment_id, fd) = spare_segments.front();
+            spare_segments.pop_front();
+            cv_segment.notify_all();
+            lock.unlock();
+
+            // oversized groups get a larger segment on the critical path
+            if (sizeof(WALSegmentHeader) + size > segment_size)
+            {
+                if (fallocate(fd, 0, 0, sizeof(WALSegmentHeader) + size) != 0 &&
+                    ftruncate(fd, sizeof(WALSegmentHeader) + size) != 0)
+                    throw std::runtime_error("fallocate wal file error.");
+            }
+
+            WALSegmentHeader header{WAL_SEGMENT_MAGIC, segment_id, segment_last_epoch_id, 0};
+            header.checksum = wal_segment_checksum(header);
+            if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+                throw std::runtime_error("write wal file error.");
+            segment_used_size = sizeof(header);
+        }
+
+        // Points iovecs to the header and wal buffers of a group. Buffers that
+        // do not fit in one writev are copied to tail.
+        static void gather_group(const WALGroupHeader &header,
+                                 const std::vector<std::string_view> &wals,
+                                 std::vector<iovec> &iovecs,
+                                 std::string &tail)
+        {
+            iovecs.clear();
+            tail.clear();
+            size_t num_gathered = std::min(wals.size(), WAL_MAX_IOVECS - 2);
+            if (num_gathered < wals.size())
+            {
+                for (size_t i = num_gathered; i < wals.size(); i++)
+                    tail.append(wals[i]);
+            }
+            iovecs.push_back({const_cast<WALGroupHeader *>(&header), sizeof(header)});
+            for (size_t i = 0; i < num_gathered; i++)
+                iovecs.push_back({const_cast<char *>(wals[i].data()), wals[i].size()});
+            if (!tail.empty())
+                iovecs.push_back({tail.data(), tail.size()});
+        }
+
+        // (server) writes a group to the active segment without io_uring
+        void write_group(const WALGroupHeader &header)
+        {
+            size_t size = sizeof(header) + header.length;
+            if (fd == EMPTY_FD || segment_used_size + size > segment_size)
+                rotate_segment(size);
+
+            gather_group(header, group_wals, group_iovecs, group_tail);
+            if ((size_t)pwritev(fd, group_iovecs.data(), group_iovecs.size(), segment_used_size) != size)
+                throw std::runtime_error("write wal file error.");
+
+            segment_used_size += size;
+            segment_last_epoch_id = writing_epoch_id;
+            unsynced_epochs.emplace_back(writing_epoch_id);
+        }
+
+        void wait_inflight_groups()
+        {
+            std::unique_lock<std::mutex> lock(inflight_mutex);
+            cv_inflight.wait(lock, [&]() { return inflight_groups.empty(); });
+        }
+
+        // Releases the txns of a written group but its Sync ones.
+        void release_written(uint64_t first_ticket, size_t num_txns, const std::vector<uint64_t> &sync_tickets)
+        {
+            auto sync_ticket = sync_tickets.begin();
+            for (auto ticket = first_ticket; ticket < first_ticket + num_txns; ticket++)
+            {
+                if (sync_ticket != sync_tickets.end() && *sync_ticket == ticket)
+                    ++sync_ticket;
+                else
+                    commits.release(ticket);
+            }
+        }
+
+        // (server) submits the write of a group without waiting for it. A
+        // group without txns only flushes the earlier ones.
+        void submit_group(const WALGroupHeader &header,
+                          uint64_t first_ticket,
+                          size_t num_txns,
+                          const std::vector<uint64_t> &sync_tickets,
+                          std::atomic<int> *num_unfinished)
+        {
+            bool logged = header.num_txns;
+            size_t size = sizeof(header) + header.length;
+            if (logged && (fd == EMPTY_FD || segment_used_size + size > segment_size))
+                rotate_segment(size);
+
+            std::unique_lock<std::mutex> lock(inflight_mutex);
+            cv_inflight.wait(lock, [&]() { return inflight_groups.size() < MAX_INFLIGHT_GROUPS; });
+            auto &group = inflight_groups.emplace_back(InflightGroup{header, {}, {}, fd, first_ticket, num_txns,
+                                                                     sync_tickets, num_unfinished, !logged, false,
+                                                                     false, false, {}});
+            if (logged)
+            {
+                gather_group(group.header, group_wals, group.iovecs, group.tail);
+                ring.prepare_writev(fd, group.iovecs.data(), group.iovecs.size(), segment_used_size,
+                                    reinterpret_cast<uintptr_t>(&group));
+                ring.submit();
+                segment_used_size += size;
+                segment_last_epoch_id = writing_epoch_id;
+                unsynced_epochs.emplace_back(writing_epoch_id);
+            }
+            if (!unsynced_epochs.empty() && (!sync_tickets.empty() || sync_due()))
+            {
+                group.sync = true;
+                group.synced_epochs.swap(unsynced_epochs);
+                last_sync_time = std::chrono::steady_clock::now();
+            }
+            lock.unlock();
+            cv_inflight.notify_all();
+        }
+
+        // (completion) flushes the written prefix of groups if any of them
+        // waits for it
+        void submit_fsync()
+        {
+            if (fsync_inflight)
+                return;
+            bool sync = false;
+            for (auto &group : inflight_groups)
+            {
+                if (!group.written)
+                    break;
+                sync |= group.sync;
+            }
+            if (!sync)
+                return;
+            for (auto &group : inflight_groups)
+            {
+                if (!group.written)
+                    break;
+                group.syncing = group.sync;
+            }
+            ring.prepare_fdatasync(inflight_groups.front().fd, FSYNC_USER_DATA);
+            ring.submit();
+            fsync_inflight = true;
+        }
+
+        // (completion) releases the txns of the written groups but the Sync
+        // ones, which are released with the flushed groups at the front in
+        // order. They hold their epochs until they finish.
+        void release_groups()
+        {
+            for (auto &group : inflight_groups)
+            {
+                if (!group.written || group.released)
+                    continue;
+                release_written(group.first_ticket, group.num_txns, group.sync_tickets);
+                if (group.num_unfinished)
+                    --*group.num_unfinished;
+                group.released = true;
+            }
+
+            auto end = inflight_groups.begin();
+            for (; end != inflight_groups.end() && end->written && !end->sync; ++end)
+            {
+                for (auto ticket : end->sync_tickets)
+                    commits.release(ticket);
+            }
+            if (end == inflight_groups.begin())
+                return;
+
+            inflight_groups.erase(inflight_groups.begin(), end);
+            cv_inflight.notify_all();
+        }
+
+        void completion_loop()
+        {
+            std::vector<std::pair<uint64_t, int>> completions;
+            std::unique_lock<std::mutex> lock(inflight_mutex);
+            while (true)
+            {
+                release_groups();
+                if (inflight_groups.empty())
+                {
+                    if (completion_closed)
+                        break;
+                    cv_inflight.wait(lock, [&]() { return !inflight_groups.empty() || completion_closed; });
+                    continue;
+                }
+                submit_fsync();
+
+                lock.unlock();
+                ring.wait([&](uint64_t user_data, int res) { completions.emplace_back(user_data, res); });
+                lock.lock();
+                for (auto [user_data, res] : completions)
+                {
+                    if (res < 0)
+                        throw std::runtime_error("write wal file error.");
+                    if (user_data == FSYNC_USER_DATA)
+                    {
+                        fsync_inflight = false;
+                        for (auto &group : inflight_groups)
+                        {
+                            if (!group.syncing)
+                                continue;
+                            sequencer.flush(group.synced_epochs);
+                            group.sync = group.syncing = false;
+                        }
+                    }
+                    else
+                    {
+                        auto group = reinterpret_cast<InflightGroup *>(user_data);
+                        if ((size_t)res != sizeof(group->header) + group->header.length)
+                            throw std::runtime_error("write wal file error.");
+                        group->written = true;
+                    }
+                }
+                completions.clear();
+            }
+        }
+
+        void server_loop()
+        {
+            while (true)
+            {
+                sequencer.advance();
+                size_t num_txns = commits.ready(MAX_GROUP_TXNS);
+                while (!num_txns && !closed.load())
+                {
+                    commits.wait_push(SERVER_SPIN_INTERVAL);
+                    sequencer.advance();
+                    num_txns = commits.ready(MAX_GROUP_TXNS);
+                    if (!num_txns && sync_due())
+                    {
+                        if (ring.valid())
+                            submit_group(WALGroupHeader{}, 0, 0, {}, nullptr);
+                        else
+                            sync_segment();
+                    }
+                }
+
+                if (!num_txns)
+                    break;
+
+                timestamp_t prev_epoch_id = 0;
+                auto [epoch_id, num_unfinished] = sequencer.next_epoch(!path.empty(), &prev_epoch_id);
+                writing_epoch_id = epoch_id;
+
+                WALGroupHeader header{writing_epoch_id, 0, 0, WAL_CHECKSUM_SEED, prev_epoch_id};
+                group_wals.clear();
+                group_sync_tickets.clear();
+
+                auto first_ticket = commits.front();
+                for (size_t i = 0; i < num_txns; i++)
+                {
+                    auto &slot = commits.at(first_ticket + i);
+                    header.checksum = wal_checksum(slot.wal, header.checksum);
+                    header.length += slot.wal.size();
+                    group_wals.emplace_back(slot.wal);
+                    ++header.num_txns;
+                    if (slot.durability == Durability::Sync)
+                        group_sync_tickets.emplace_back(first_ticket + i);
+                    slot.epoch_id = writing_epoch_id;
+                    slot.num_unfinished = num_unfinished;
+                    ++*num_unfinished;
+                }
+                commits.pop(num_txns);
+                if (sequencer.capturing())
+                    sequencer.capture(writing_epoch_id, group_wals);
+
+                if (ring.valid())
+                {
+                    submit_group(header, first_ticket, num_txns, group_sync_tickets, num_unfinished);
+                    continue;
+                }
+
+                if (!path.empty())
+                    write_group(header);
+                release_written(first_ticket, num_txns, group_sync_tickets);
+                --*num_unfinished;
+
+                if (sync_due() || (!unsynced_epochs.empty() && !group_sync_tickets.empty()))
+                    sync_segment();
+                for (auto ticket : group_sync_tickets)
+                    commits.release(ticket);
+            }
+            wait_inflight_groups();
+            if (!unsynced_epochs.empty())
+                sync_segment();
+        }
+    };
+
+} // namespace livegraph
@@ -0,0 +1,216 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "types.hpp"
+#include "wal.hpp"
+#include "wal_stream.hpp"
+
+namespace livegraph
+{
+    // Reads the groups of a WAL stream directory while the primary keeps
+    // appending to it, without modifying anything. The tail is lost when the
+    // primary releases segments that have not been read yet.
+    class WALTail
+    {
+    public:
+        WALTail(std::string _path, timestamp_t _begin_epoch_id)
+            : path(_path),
+              begin_epoch_id(_begin_epoch_id),
+              prev_epoch_id(0),
+              fd(EMPTY_FD),
+              segment_id(0),
+              segment(),
+              offset(0),
+              lost(false)
+        {
+        }
+
+        WALTail(const WALTail &) = delete;
+
+        WALTail(WALTail &&) = delete;
+
+        ~WALTail() { close_segment(); }
+
+        bool is_lost() const { return lost; }
+
+        // Calls replay(header, txns) for every complete group after
+        // begin_epoch_id written so far, in commit order, and flush() before
+        // the txns are unmapped. Returns the number of groups.
+        template <typename F, typename G> size_t poll(F replay, G flush)
+        {
+            size_t num_groups = 0;
+            if (fd == EMPTY_FD && !open_first_segment())
+                return num_groups;
+            while (true)
+            {
+                WALGroupHeader header;
+                size_t length = check_wal_group(segment.substr(offset), prev_epoch_id, header);
+                if (length)
+                {
+                    if (header.epoch_id > begin_epoch_id)
+                    {
+                        replay(header, segment.substr(offset + sizeof(header), header.length));
+                        ++num_groups;
+                    }
+                    prev_epoch_id = header.epoch_id;
+                    offset += length;
+                    continue;
+                }
+
+                // the primary only rotates after writing all groups of a segment
+                int next_fd = open_segment(segment_id + 1);
+                if (next_fd == EMPTY_FD)
+                {
+                    check_released();
+                    break;
+                }
+                flush();
+                close_segment();
+                map_segment(next_fd, segment_id + 1);
+            }
+            return num_groups;
+        }
+
+    private:
+        const std::string path;
+        const timestamp_t begin_epoch_id;
+        timestamp_t prev_epoch_id; // the last group read
+        int fd;
+        uint64_t segment_id;
+        std::string_view segment;
+        size_t offset;
+        bool lost;
+
+        constexpr static int EMPTY_FD = -1;
+
+        // Starts from the last segment before begin_epoch_id.
+        bool open_first_segment()
+        {
+            auto ids = list_wal_segments(path);
+            for (size_t i = ids.size(); i-- > 0;)
+            {
+                int segment_fd = open(wal_segment_path(path, ids[i]).c_str(), O_RDONLY);
+                if (segment_fd == EMPTY_FD)
+                    continue;
+                WALSegmentHeader header;
+                if (pread(segment_fd, &header, sizeof(header), 0) == sizeof(header) &&
+                    check_wal_segment(header, ids[i]) && header.prev_epoch_id <= begin_epoch_id)
+                {
+                    prev_epoch_id = header.prev_epoch_id;
+                    map_segment(segment_fd, ids[i]);
+                    return true;
+                }
+                close(segment_fd);
+            }
+            // the groups after begin_epoch_id are released, or not written yet
+            for (auto id : ids)
+            {
+                int segment_fd = open(wal_segment_path(path, id).c_str(), O_RDONLY);
+                if (segment_fd == EMPTY_FD)
+                    continue;
+                WALSegmentHeader header;
+                if (pread(segment_fd, &header, sizeof(header), 0) == sizeof(header) && check_wal_segment(header, id))
+                    lost = true;
+                close(segment_fd);
+                if (lost)
+                    break;
+            }
+            return false;
+        }
+
+        // Returns the segment if it is active and follows the groups read.
+        int open_segment(uint64_t id)
+        {
+            int segment_fd = open(wal_segment_path(path, id).c_str(), O_RDONLY);
+            if (segment_fd == EMPTY_FD)
+                return EMPTY_FD;
+            WALSegmentHeader header;
+            if (pread(segment_fd, &header, sizeof(header), 0) != sizeof(header) || !check_wal_segment(header, id) ||
+                header.prev_epoch_id != prev_epoch_id)
+            {
+                // a later prev_epoch_id means groups of this segment are not seen yet
+                if (check_wal_segment(header, id) && header.prev_epoch_id < prev_epoch_id)
+                    lost = true;
+                close(segment_fd);
+                return EMPTY_FD;
+            }
+            return segment_fd;
+        }
+
+        void map_segment(int segment_fd, uint64_t id)
+        {
+            // the segment is extended before its header is written
+            struct stat st;
+            if (fstat(segment_fd, &st) != 0)
+                throw std::runtime_error("stat wal file error.");
+            auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, segment_fd, 0);
+            if (data == MAP_FAILED)
+                throw std::runtime_error("mmap wal file error.");
+            fd = segment_fd;
+            segment_id = id;
+            segment = std::string_view(reinterpret_cast<char *>(data), st.st_size);
+            offset = sizeof(WALSegmentHeader);
+        }
+
+        void close_segment()
+        {
+            if (fd == EMPTY_FD)
+                return;
+            munmap(const_cast<char *>(segment.data()), segment.size());
+            close(fd);
+            fd = EMPTY_FD;
+        }
+
+        // The current or the next segment is deleted or recycled by the
+        // primary, while a later one is active.
+        void check_released()
+        {
+            struct stat st;
+            WALSegmentHeader header;
+            memcpy(&header, segment.data(), sizeof(header));
+            if (fstat(fd, &st) != 0 || st.st_nlink == 0 || !check_wal_segment(header, segment_id))
+            {
+                lost = true;
+                return;
+            }
+            if (access(wal_segment_path(path, segment_id + 1).c_str(), F_OK) == 0)
+                return;
+            for (auto id : list_wal_segments(path))
+            {
+                if (id <= segment_id + 1)
+                    continue;
+                int segment_fd = open(wal_segment_path(path, id).c_str(), O_RDONLY);
+                if (segment_fd == EMPTY_FD)
+                    continue;
+                if (pread(segment_fd, &header, sizeof(header), 0) == sizeof(header) && check_wal_segment(header, id))
+                    lost = true;
+                close(segment_fd);
+                if (lost)
+                    break;
+            }
+        }
+    };
+
+} // namespace livegraph
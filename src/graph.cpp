@@ -13,182 +13,1117 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <thread>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "core/edge_iterator.hpp"
 #include "core/graph.hpp"
 #include "core/transaction.hpp"
+#include "core/wal_tail.hpp"
 
 using namespace livegraph;
 
-Transaction Graph::begin_transaction()
+static std::string_view map_file(const std::string &path)
+{
+    int fd = path.empty() ? -1 : open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return std::string_view();
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error("stat file error.");
+    void *data = nullptr;
+    if (st.st_size)
+    {
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+            throw std::runtime_error("mmap file error.");
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return std::string_view(reinterpret_cast<char *>(data), st.st_size);
+}
+
+static void unmap_file(std::string_view file)
 {
+    if (!file.empty())
+        munmap(const_cast<char *>(file.data()), file.size());
+}
+
+Transaction Graph::begin_transaction() { return begin_transaction(durability); }
+
+Transaction Graph::begin_transaction(Durability txn_durability)
+{
+    if (is_follower)
+        throw std::invalid_argument("The graph is a follower.");
     auto local_txn_id = transaction_id.fetch_add(1, std::memory_order_relaxed) + 1; // txn_id begin from 1
-    auto read_epoch_id = epoch_id.load(std::memory_order_acquire);
-    read_epoch_table.local() = read_epoch_id;
-    if (local_txn_id % COMPACTION_CYCLE == 0)
+    auto [read_epoch_id, epoch_handle] = epochs.enter();
+    if (local_txn_id % COMPACTION_CYCLE == 0 && !background_compaction.load(std::memory_order_relaxed))
         compact(local_txn_id);
-    return Transaction(*this, local_txn_id, read_epoch_id, false, true);
+    return Transaction(*this, local_txn_id, read_epoch_id, false, true, txn_durability, epoch_handle);
 }
 
 Transaction Graph::begin_read_only_transaction()
 {
-    auto read_epoch_id = epoch_id.load(std::memory_order_acquire);
-    read_epoch_table.local() = read_epoch_id;
-    return Transaction(*this, RO_TRANSACTION, read_epoch_id, false, false);
+    auto [read_epoch_id, epoch_handle] = epochs.enter();
+    return Transaction(*this, RO_TRANSACTION, read_epoch_id, false, false, Durability::None, epoch_handle);
 }
 
 Transaction Graph::begin_batch_loader()
 {
-    auto read_epoch_id = epoch_id.load(std::memory_order_acquire);
-    read_epoch_table.local() = read_epoch_id;
-    return Transaction(*this, RO_TRANSACTION, read_epoch_id, true, false);
+    if (is_follower)
+        throw std::invalid_argument("The graph is a follower.");
+    auto [read_epoch_id, epoch_handle] = epochs.enter();
+    return Transaction(*this, RO_TRANSACTION, read_epoch_id, true, false, Durability::None, epoch_handle);
 }
 
-timestamp_t Graph::compact(timestamp_t read_epoch_id)
+std::shared_ptr<ChangeStream> Graph::subscribe(size_t capacity) { return commit_manager.subscribe(capacity); }
+
+void Graph::partitioned_scan(std::function<void(Transaction &, vertex_t)> f)
 {
-    if (read_epoch_id == NO_TRANSACTION)
-        read_epoch_id = epoch_id.load();
-    for (auto id : read_epoch_table)
+    // keeps the snapshot from compaction until every thread is done
+    auto snapshot = begin_read_only_transaction();
+    auto read_epoch_id = snapshot.get_read_epoch_id();
+    vertex_t num_vertices = vertex_id.load();
+    auto num_ranges = (num_vertices + NUMA_VERTEX_RANGE - 1) / NUMA_VERTEX_RANGE;
+    auto num_nodes = block_manager.num_nodes();
+    bool bind = numa_placement == NumaPlacement::Vertex && num_nodes > 1;
+
+    std::vector<std::atomic<size_t>> next_ranges(num_nodes); // by node, counted in rounds over the nodes
+    for (auto &next_range : next_ranges)
+        next_range = 0;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::vector<std::thread> threads;
+    for (size_t node = 0; node < num_nodes; node++)
     {
-        if (id != NO_TRANSACTION && id < read_epoch_id)
-            read_epoch_id = id;
+        size_t num_threads =
+            num_nodes == 1 ? std::thread::hardware_concurrency() : numa_topology().node_cpus[node].size();
+        num_threads = std::max<size_t>(num_threads, 1);
+        for (size_t i = 0; i < num_threads; i++)
+        {
+            threads.emplace_back([&, node]() {
+                try
+                {
+                    if (bind)
+                        bind_numa_node(node);
+                    Transaction txn(*this, RO_TRANSACTION, read_epoch_id, false, false, Durability::None);
+                    size_t range;
+                    while ((range = next_ranges[node]++ * num_nodes + node) < num_ranges)
+                    {
+                        auto end = std::min((range + 1) * NUMA_VERTEX_RANGE, num_vertices);
+                        for (auto vertex = range * NUMA_VERTEX_RANGE; vertex < end; vertex++)
+                            f(txn, vertex);
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+            });
+        }
     }
+    for (auto &thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+timestamp_t Graph::min_read_epoch(timestamp_t read_epoch_id)
+{
+    auto watermark = epochs.low_watermark();
+    if (read_epoch_id == NO_TRANSACTION || watermark < read_epoch_id)
+        read_epoch_id = watermark;
+    return read_epoch_id;
+}
 
-    size_t recycled_block_size = 0;
-    std::unordered_set<vertex_t> new_compact_table;
+void Graph::reclaim_blocks(timestamp_t read_epoch_id)
+{
+    epochs.reclaim(read_epoch_id, [&](uintptr_t pointer, order_t order) { block_manager.free(pointer, order); });
+    block_manager.trim();
+}
 
-    for (vertex_t vid : compact_table.local())
+void Graph::retire_vertex(vertex_t vid)
+{
+    // newest first, so that each old version is uncounted as garbage once
+    auto retire_chain = [&](uintptr_t pointer) {
+        while (auto block = block_manager.convert<N2OBlockHeader>(pointer))
+        {
+            count_block(pointer, -1);
+            epochs.retire(pointer, block->get_order());
+            pointer = block->get_prev_pointer();
+        }
+    };
+
+    auto edge_label_pointer = edge_label_ptrs[vid];
+    auto vertex_pointer = vertex_ptrs[vid];
+    vertex_ptrs[vid] = block_manager.NULLPOINTER;
+    edge_label_ptrs[vid] = block_manager.NULLPOINTER;
+
+    auto edge_label_block = block_manager.convert<EdgeLabelBlockHeader>(edge_label_pointer);
+    for (size_t i = 0; edge_label_block && i < edge_label_block->get_num_entries(); i++)
     {
-        if (!vertex_futexes[vid].try_lock_for(TIMEOUT))
+        auto pointer = edge_label_block->get_entries()[i].get_pointer();
+        if (auto edge_block = block_manager.convert<EdgeBlockHeader>(pointer))
+            count_deleted_edges(-count_deleted_entries(edge_block));
+        retire_chain(pointer);
+    }
+    retire_chain(edge_label_pointer);
+    retire_chain(vertex_pointer);
+}
+
+int64_t Graph::count_deleted_entries(EdgeBlockHeader *edge_block)
+{
+    int64_t num_deleted_edges = 0;
+    auto entries = edge_block->get_entries();
+    for (size_t i = 0; i < edge_block->get_num_entries(); i++)
+    {
+        entries--;
+        if (entries->get_deletion_time() != ROLLBACK_TOMBSTONE)
+            num_deleted_edges++;
+    }
+    return num_deleted_edges;
+}
+
+void Graph::count_vertex(vertex_t vid)
+{
+    bool dirty = false;
+    auto count_chain = [&](uintptr_t pointer) {
+        while (auto block = block_manager.convert<N2OBlockHeader>(pointer))
         {
-            new_compact_table.emplace(vid);
-            continue;
+            count_block(pointer, 1);
+            pointer = block->get_prev_pointer();
+            dirty |= pointer != block_manager.NULLPOINTER;
+        }
+    };
+
+    count_chain(vertex_ptrs[vid]);
+    count_chain(edge_label_ptrs[vid]);
+    auto edge_label_block = block_manager.convert<EdgeLabelBlockHeader>(edge_label_ptrs[vid]);
+    for (size_t i = 0; edge_label_block && i < edge_label_block->get_num_entries(); i++)
+    {
+        auto pointer = edge_label_block->get_entries()[i].get_pointer();
+        if (auto edge_block = block_manager.convert<EdgeBlockHeader>(pointer))
+        {
+            auto num_deleted_edges = count_deleted_entries(edge_block);
+            count_deleted_edges(num_deleted_edges);
+            dirty |= num_deleted_edges > 0;
+        }
+        count_chain(pointer);
+    }
+    if (dirty)
+        mark_dirty(vid);
+}
+
+bool Graph::compact_vertex(vertex_t vid,
+                           timestamp_t read_epoch_id,
+                           size_t &compacted_size,
+                           std::vector<EdgeCompactionCursor> &cursors)
+{
+    bool need_future_compact = false;
+
+    auto compact_n2o_blocks = [&](uintptr_t pointer) {
+        auto block = block_manager.convert<N2OBlockHeader>(pointer);
+        while (block)
+        {
+            // The first block before the minimal epoch
+            // Blocks before that are garbage
+            if (cmp_timestamp(block->get_creation_time_pointer(), read_epoch_id) < 0)
+            {
+                std::vector<std::pair<uintptr_t, order_t>> pointers_to_recycle;
+
+                auto garbage_pointer = block->get_prev_pointer();
+                auto garbage_block = block_manager.convert<N2OBlockHeader>(garbage_pointer);
+                while (garbage_block)
+                {
+                    pointers_to_recycle.emplace_back(garbage_pointer, garbage_block->get_order());
+                    garbage_pointer = garbage_block->get_prev_pointer();
+                    garbage_block = block_manager.convert<N2OBlockHeader>(garbage_pointer);
+                }
+
+                block->set_prev_pointer(block_manager.NULLPOINTER);
+                for (auto [pointer, order] : pointers_to_recycle)
+                {
+                    compacted_size += 1ul << order;
+                    count_block(pointer, -1, true);
+                    epochs.retire(pointer, order);
+                }
+
+                break;
+            }
+
+            pointer = block->get_prev_pointer();
+            block = block_manager.convert<VertexBlockHeader>(pointer);
+            // The next block is garbage with larger epoch
+            if (block)
+                need_future_compact = true;
         }
+    };
+
+    // Compact VertexBlock
+    compact_n2o_blocks(vertex_ptrs[vid]);
 
-        bool need_future_compact = false;
+    // Compact EdgeLabelBlock
+    compact_n2o_blocks(edge_label_ptrs[vid]);
 
-        auto compact_n2o_blocks = [&](uintptr_t pointer) {
-            auto block = block_manager.convert<N2OBlockHeader>(pointer);
-            while (block)
+    // Compact EdgeBlock
+    {
+        auto edge_label_pointer = edge_label_ptrs[vid];
+        auto edge_label_block = block_manager.convert<EdgeLabelBlockHeader>(edge_label_pointer);
+        if (edge_label_block)
+        {
+            for (size_t i = 0; i < edge_label_block->get_num_entries(); i++)
             {
-                // The first block before the minimal epoch
-                // Blocks before that are garbage
-                if (cmp_timestamp(block->get_creation_time_pointer(), read_epoch_id) < 0)
+                auto &label_entry = edge_label_block->get_entries()[i];
+                auto pointer = label_entry.get_pointer();
+                auto edge_block = block_manager.convert<EdgeBlockHeader>(pointer);
+                if (!edge_block)
+                    continue;
+                compact_n2o_blocks(pointer);
+
+                if (edge_block->get_order() >= INCREMENTAL_COMPACT_ORDER)
                 {
-                    std::vector<std::pair<uintptr_t, order_t>> pointers_to_recycle;
+                    auto num_entries = edge_block->get_num_entries_data_length_atomic().first;
+                    cursors.push_back({label_entry.get_label(), pointer, edge_block->get_committed_time(),
+                                       num_entries, 0, 0, 0, 0, block_manager.NULLPOINTER, 0});
+                    continue;
+                }
 
-                    auto garbage_pointer = block->get_prev_pointer();
-                    auto garbage_block = block_manager.convert<N2OBlockHeader>(garbage_pointer);
-                    while (garbage_block)
-                    {
-                        pointers_to_recycle.emplace_back(garbage_pointer, garbage_block->get_order());
-                        garbage_pointer = garbage_block->get_prev_pointer();
-                        garbage_block = block_manager.convert<N2OBlockHeader>(garbage_pointer);
-                    }
+                size_t new_num_entries = 0;
+                size_t new_data_length = 0;
 
-                    block->set_prev_pointer(block_manager.NULLPOINTER);
-                    for (auto [pointer, order] : pointers_to_recycle)
+                // Scan deleted edges
+                auto entries = edge_block->get_entries();
+                auto data = edge_block->get_data();
+                auto num_entries = edge_block->get_num_entries();
+                for (size_t i = 0; i < num_entries; i++)
+                {
+                    entries--;
+                    if (cmp_timestamp(entries->get_deletion_time_pointer(), read_epoch_id) > 0)
                     {
-                        recycled_block_size += 1ul << order;
-                        block_manager.free(pointer, order);
+                        new_num_entries++;
+                        new_data_length += entries->get_length();
                     }
+                }
+                entries = edge_block->get_entries(); // Reset cursor
+
+                if (new_num_entries == num_entries)
+                    continue;
+
+                // Copy a new edge block
+                need_future_compact = true;
+
+                auto size = sizeof(EdgeBlockHeader) + new_num_entries * sizeof(EdgeEntry) + new_data_length;
+                auto order = size_to_order(size);
+
+                if (order > edge_block->BLOOM_FILTER_PORTION &&
+                    size + (1ul << (order - edge_block->BLOOM_FILTER_PORTION)) >=
+                        (1ul << edge_block->BLOOM_FILTER_THRESHOLD))
+                {
+                    size += 1ul << (order - edge_block->BLOOM_FILTER_PORTION);
+                }
+                order = size_to_order(size);
+
+                auto new_pointer = alloc_block(order, vid);
+                compacted_size += 1ul << order;
 
-                    break;
+                auto new_edge_block = block_manager.convert<EdgeBlockHeader>(new_pointer);
+                new_edge_block->fill(order, vid, read_epoch_id, pointer, edge_block->get_committed_time());
+                count_block(new_pointer, 1);
+                count_deleted_edges(-(int64_t)(num_entries - new_num_entries));
+
+                auto bloom_filter = new_edge_block->get_bloom_filter();
+                for (size_t i = 0; i < num_entries; i++)
+                {
+                    entries--;
+                    if (cmp_timestamp(entries->get_deletion_time_pointer(), read_epoch_id) > 0)
+                        new_edge_block->append(*entries, data, bloom_filter);
+                    data += entries->get_length();
                 }
 
-                pointer = block->get_prev_pointer();
-                block = block_manager.convert<VertexBlockHeader>(pointer);
-                // The next block is garbage with larger epoch
-                if (block)
-                    need_future_compact = true;
+                label_entry.set_pointer(new_pointer);
+
+                // printf("Compact %lu edges, %lu data\n",
+                // num_entries-new_num_entries,
+                // edge_block->get_data_length()-new_data_length);
+            }
+        }
+    }
+
+    return need_future_compact;
+}
+
+bool Graph::edge_cursor_valid(vertex_t vid, const EdgeCompactionCursor &cursor)
+{
+    auto edge_label_block = block_manager.convert<EdgeLabelBlockHeader>(edge_label_ptrs[vid]);
+    for (size_t i = 0; edge_label_block && i < edge_label_block->get_num_entries(); i++)
+    {
+        auto &label_entry = edge_label_block->get_entries()[i];
+        if (label_entry.get_label() != cursor.label)
+            continue;
+        auto edge_block = block_manager.convert<EdgeBlockHeader>(cursor.pointer);
+        return label_entry.get_pointer() == cursor.pointer &&
+               edge_block->get_committed_time() == cursor.committed_time &&
+               edge_block->get_num_entries_data_length_atomic().first == cursor.num_entries;
+    }
+    return false;
+}
+
+bool Graph::compact_edge_slice(vertex_t vid,
+                               EdgeCompactionCursor &cursor,
+                               timestamp_t read_epoch_id,
+                               size_t &compacted_size)
+{
+    auto deadline = std::chrono::steady_clock::now() + COMPACT_SLICE_TIME;
+    auto edge_block = block_manager.convert<EdgeBlockHeader>(cursor.pointer);
+    auto entries = edge_block->get_entries() - 1;
+    auto data = edge_block->get_data();
+
+    if (cursor.new_pointer == block_manager.NULLPOINTER)
+    {
+        // Scan deleted edges
+        for (; cursor.index < cursor.num_entries; cursor.index++)
+        {
+            if (cursor.index % COMPACT_SLICE_CHECK == 0 && std::chrono::steady_clock::now() > deadline)
+                return false;
+            auto entry = entries - cursor.index;
+            if (cmp_timestamp(entry->get_deletion_time_pointer(), read_epoch_id) > 0)
+            {
+                cursor.new_num_entries++;
+                cursor.new_data_length += entry->get_length();
+            }
+        }
+        if (cursor.new_num_entries == cursor.num_entries)
+            return true;
+
+        auto size = sizeof(EdgeBlockHeader) + cursor.new_num_entries * sizeof(EdgeEntry) + cursor.new_data_length;
+        auto order = size_to_order(size);
+        if (order > edge_block->BLOOM_FILTER_PORTION &&
+            size + (1ul << (order - edge_block->BLOOM_FILTER_PORTION)) >= (1ul << edge_block->BLOOM_FILTER_THRESHOLD))
+        {
+            size += 1ul << (order - edge_block->BLOOM_FILTER_PORTION);
+        }
+        cursor.new_order = size_to_order(size);
+
+        cursor.new_pointer = alloc_block(cursor.new_order, vid);
+        compacted_size += 1ul << cursor.new_order;
+        auto new_edge_block = block_manager.convert<EdgeBlockHeader>(cursor.new_pointer);
+        new_edge_block->fill(cursor.new_order, vid, read_epoch_id, cursor.pointer, cursor.committed_time);
+        count_block(cursor.new_pointer, 1);
+        cursor.index = 0;
+        cursor.data_offset = 0;
+    }
+
+    // Copy the live edges
+    auto new_edge_block = block_manager.convert<EdgeBlockHeader>(cursor.new_pointer);
+    auto bloom_filter = new_edge_block->get_bloom_filter();
+    for (; cursor.index < cursor.num_entries; cursor.index++)
+    {
+        if (cursor.index % COMPACT_SLICE_CHECK == 0 && std::chrono::steady_clock::now() > deadline)
+            return false;
+        auto entry = entries - cursor.index;
+        if (cmp_timestamp(entry->get_deletion_time_pointer(), read_epoch_id) > 0)
+            new_edge_block->append(*entry, data + cursor.data_offset, bloom_filter);
+        cursor.data_offset += entry->get_length();
+    }
+
+    auto edge_label_block = block_manager.convert<EdgeLabelBlockHeader>(edge_label_ptrs[vid]);
+    for (size_t i = 0; i < edge_label_block->get_num_entries(); i++)
+    {
+        auto &label_entry = edge_label_block->get_entries()[i];
+        if (label_entry.get_label() == cursor.label)
+            label_entry.set_pointer(cursor.new_pointer);
+    }
+    count_deleted_edges(-(int64_t)(cursor.num_entries - cursor.new_num_entries));
+    return true;
+}
+
+void Graph::release_edge_cursor(EdgeCompactionCursor &cursor)
+{
+    if (cursor.new_pointer == block_manager.NULLPOINTER)
+        return;
+    count_block(cursor.new_pointer, -1);
+    block_manager.free(cursor.new_pointer, cursor.new_order);
+    cursor.new_pointer = block_manager.NULLPOINTER;
+}
+
+void Graph::try_compact_vertex(vertex_t vid, timestamp_t read_epoch_id, size_t &compacted_size)
+{
+    if (!vertex_futexes[vid].try_lock_for(TIMEOUT))
+    {
+        mark_dirty(vid);
+        return;
+    }
+    std::vector<EdgeCompactionCursor> cursors;
+    bool need_future_compact = compact_vertex(vid, read_epoch_id, compacted_size, cursors);
+
+    // The futex is released between slices, and the copy is dropped if the
+    // block is written meanwhile.
+    for (auto &cursor : cursors)
+    {
+        bool finished = false;
+        while (edge_cursor_valid(vid, cursor) && !(finished = compact_edge_slice(vid, cursor, read_epoch_id,
+                                                                                    compacted_size)))
+        {
+            vertex_futexes[vid].unlock();
+            std::this_thread::yield();
+            if (!vertex_futexes[vid].try_lock_for(TIMEOUT))
+            {
+                release_edge_cursor(cursor);
+                mark_dirty(vid);
+                return;
+            }
+        }
+        if (!finished)
+            release_edge_cursor(cursor);
+        if (!finished || cursor.new_pointer != block_manager.NULLPOINTER)
+            need_future_compact = true;
+    }
+
+    vertex_futexes[vid].unlock();
+    if (need_future_compact)
+        mark_dirty(vid);
+}
+
+timestamp_t Graph::compact(timestamp_t read_epoch_id)
+{
+    read_epoch_id = min_read_epoch(read_epoch_id);
+
+    auto vertices = dirty_vertices.drain();
+
+    size_t compacted_size = 0;
+    for (vertex_t vid : vertices)
+        try_compact_vertex(vid, read_epoch_id, compacted_size);
+
+    reclaim_blocks(read_epoch_id);
+
+    return read_epoch_id;
+}
+
+size_t Graph::migrate_blocks(timestamp_t read_epoch_id)
+{
+    if (!block_manager.tiered())
+        return 0;
+
+    // frees the copies left by the last pass
+    read_epoch_id = compact(read_epoch_id);
+
+    size_t migrated_size = 0;
+    std::vector<std::pair<uintptr_t, size_t>> cold_ranges;
+    auto num_vertices = vertex_id.load();
+    for (vertex_t vid = 0; vid < num_vertices; vid++)
+    {
+        bool hot = (*vertex_accesses)[vid].exchange(0, std::memory_order_relaxed);
+        auto edge_label_block = block_manager.convert<EdgeLabelBlockHeader>(edge_label_ptrs[vid]);
+        if (!edge_label_block || !vertex_futexes[vid].try_lock_for(TIMEOUT))
+            continue;
+
+        bool migrated = false;
+        for (size_t i = 0; i < edge_label_block->get_num_entries(); i++)
+        {
+            auto &label_entry = edge_label_block->get_entries()[i];
+            auto pointer = label_entry.get_pointer();
+            auto edge_block = block_manager.convert<EdgeBlockHeader>(pointer);
+            if (!edge_block || block_manager.is_cold(pointer) != hot ||
+                cmp_timestamp(edge_block->get_creation_time_pointer(), read_epoch_id) > 0)
+                continue;
+
+            // The copy is visible from the read epoch, so the original is
+            // freed once no reader can be on it.
+            auto order = edge_block->get_order();
+            auto new_pointer = hot ? alloc_block(order, vid) : block_manager.alloc_cold(order);
+            auto new_edge_block = block_manager.convert<EdgeBlockHeader>(new_pointer);
+            memcpy(new_edge_block, edge_block, 1ul << order);
+            new_edge_block->set_creation_time(read_epoch_id);
+            new_edge_block->set_prev_pointer(pointer);
+            count_block(new_pointer, 1);
+
+            label_entry.set_pointer(new_pointer);
+            if (!hot)
+                cold_ranges.emplace_back(new_pointer, 1ul << order);
+            migrated_size += 1ul << order;
+            migrated = true;
+        }
+
+        if (migrated)
+            mark_dirty(vid);
+        vertex_futexes[vid].unlock();
+    }
+
+    // the cold blocks leave memory now, merged into contiguous ranges
+    std::sort(cold_ranges.begin(), cold_ranges.end());
+    for (size_t i = 0; i < cold_ranges.size();)
+    {
+        auto [begin, end] = std::make_pair(cold_ranges[i].first, cold_ranges[i].first + cold_ranges[i].second);
+        for (++i; i < cold_ranges.size() && cold_ranges[i].first == end; i++)
+            end += cold_ranges[i].second;
+        block_manager.evict(begin, end - begin);
+    }
+    // and so do the hot blocks freed by the last pass
+    block_manager.trim(true);
+
+    return migrated_size;
+}
+
+timestamp_t Graph::compact_all(size_t num_threads, timestamp_t read_epoch_id)
+{
+    read_epoch_id = min_read_epoch(read_epoch_id);
+    auto vertices = dirty_vertices.drain();
+
+    tbb::task_arena arena(num_threads ? (int)num_threads : tbb::task_arena::automatic);
+    arena.execute([&]() {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, vertices.size(), COMPACT_GRAIN_SIZE),
+                          [&](const tbb::blocked_range<size_t> &range) {
+                              size_t compacted_size = 0;
+                              for (auto i = range.begin(); i != range.end(); i++)
+                                  try_compact_vertex(vertices[i], read_epoch_id, compacted_size);
+                          });
+    });
+
+    reclaim_blocks(read_epoch_id);
+
+    return read_epoch_id;
+}
+
+class Graph::Compactor
+{
+public:
+    Compactor(Graph &_graph, CompactionOptions _options)
+        : graph(_graph),
+          options(_options),
+          mutex(),
+          cv(),
+          stopped(false),
+          round(0),
+          num_finished(0),
+          read_epoch_id(NO_TRANSACTION),
+          vertices(),
+          threads()
+    {
+        threads.emplace_back([this]() { schedule(); });
+        for (size_t i = 0; i < options.num_threads; i++)
+            threads.emplace_back([this, i]() { work(i); });
+    }
+
+    ~Compactor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped.store(true);
+        }
+        cv.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+private:
+    Graph &graph;
+    const CompactionOptions options;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<bool> stopped;
+    size_t round;        // guarded by the mutex
+    size_t num_finished; // guarded by the mutex
+    timestamp_t read_epoch_id;
+    std::vector<vertex_t> vertices; // of the round, shared by the workers
+    std::vector<std::thread> threads;
+
+    bool triggered()
+    {
+        auto stats = graph.stats();
+        auto size = stats.vertex_block_size + stats.edge_block_size + stats.edge_label_block_size;
+        auto garbage_size = stats.garbage_size + stats.retired_size + stats.num_deleted_edges * sizeof(EdgeEntry);
+        return garbage_size && garbage_size >= options.garbage_ratio * size;
+    }
+
+    void schedule()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, options.interval, [&]() { return stopped.load(); }))
+        {
+            if (!triggered())
+                continue;
+            read_epoch_id = graph.min_read_epoch(NO_TRANSACTION);
+            vertices = graph.dirty_vertices.drain();
+            if (vertices.empty())
+            {
+                graph.reclaim_blocks(read_epoch_id);
+                continue;
+            }
+            round++;
+            num_finished = 0;
+            cv.notify_all();
+            cv.wait(lock, [&]() { return num_finished == options.num_threads; });
+            graph.reclaim_blocks(read_epoch_id);
+        }
+    }
+
+    void work(size_t index)
+    {
+        size_t last_round = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            cv.wait(lock, [&]() { return stopped.load() || round != last_round; });
+            // a pending round is still finished, for the scheduler waiting on it
+            // and to mark the share dirty again
+            if (round == last_round)
+                return;
+            last_round = round;
+            lock.unlock();
+            compact_share(index);
+            lock.lock();
+            if (++num_finished == options.num_threads)
+                cv.notify_all();
+        }
+    }
+
+    // Vertices left when stopped are marked dirty again, for the writers or
+    // the next service.
+    void compact_share(size_t index)
+    {
+        auto start = std::chrono::steady_clock::now();
+        size_t compacted_size = 0;
+        for (size_t i = index; i < vertices.size(); i += options.num_threads)
+        {
+            if (stopped.load())
+            {
+                graph.mark_dirty(vertices[i]);
+                continue;
             }
-        };
+            graph.try_compact_vertex(vertices[i], read_epoch_id, compacted_size);
+
+            if (options.max_bytes_per_second)
+            {
+                auto seconds = (double)compacted_size * options.num_threads / options.max_bytes_per_second;
+                auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                            std::chrono::duration<double>(seconds));
+                while (!stopped.load() && std::chrono::steady_clock::now() < deadline)
+                    std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                        deadline - std::chrono::steady_clock::now(), PACING_INTERVAL));
+            }
+        }
+    }
+
+    constexpr static auto PACING_INTERVAL = std::chrono::milliseconds(10);
+};
+
+void Graph::start_compaction(CompactionOptions options)
+{
+    if (is_follower)
+        throw std::invalid_argument("The graph is a follower.");
+    if (!options.num_threads)
+        throw std::invalid_argument("The compaction needs a thread.");
+    std::lock_guard<std::mutex> lock(compactor_mutex);
+    if (compactor)
+        throw std::invalid_argument("The compaction is running.");
+    compactor = std::make_shared<Compactor>(*this, options);
+    background_compaction.store(true);
+}
+
+void Graph::stop_compaction()
+{
+    std::lock_guard<std::mutex> lock(compactor_mutex);
+    compactor.reset();
+    background_compaction.store(false);
+}
+
+GraphStats Graph::stats()
+{
+    int64_t sizes[7] = {};
+    for (auto &counters : stat_counters)
+    {
+        sizes[0] += counters.vertex_block_size.load(std::memory_order_relaxed);
+        sizes[1] += counters.edge_block_size.load(std::memory_order_relaxed);
+        sizes[2] += counters.edge_label_block_size.load(std::memory_order_relaxed);
+        sizes[3] += counters.bloom_filter_size.load(std::memory_order_relaxed);
+        sizes[4] += counters.num_garbage_blocks.load(std::memory_order_relaxed);
+        sizes[5] += counters.garbage_size.load(std::memory_order_relaxed);
+        sizes[6] += counters.num_deleted_edges.load(std::memory_order_relaxed);
+    }
+    for (auto &size : sizes)
+        size = std::max<int64_t>(size, 0);
+    return {(size_t)sizes[0], (size_t)sizes[1], (size_t)sizes[2], (size_t)sizes[3],
+            (size_t)sizes[4], (size_t)sizes[5], (size_t)sizes[6], epochs.get_retired_size(), block_manager.stats()};
+}
+
+timestamp_t Graph::checkpoint()
+{
+    if (checkpoint_path.empty())
+        throw std::invalid_argument("The graph has no WAL.");
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto txn = begin_read_only_transaction();
+    auto checkpoint_epoch_id = txn.get_read_epoch_id();
+    auto num_vertices = vertex_id.load(std::memory_order_acquire);
+
+    // ids recycled later are also recovered from the WAL
+    std::vector<vertex_t> recycled_vertices;
+    vertex_t recycled_vid = 0;
+    while (recycled_vertex_ids.try_pop(recycled_vid))
+        recycled_vertices.emplace_back(recycled_vid);
+    for (auto vid : recycled_vertices)
+        recycled_vertex_ids.push(vid);
 
-        // Compact VertexBlock
-        compact_n2o_blocks(vertex_ptrs[vid]);
+    auto tmp_path = checkpoint_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd == -1)
+        throw std::runtime_error("open checkpoint file error.");
 
-        // Compact EdgeLabelBlock
-        compact_n2o_blocks(edge_label_ptrs[vid]);
+    CheckpointHeader header{
+        CHECKPOINT_MAGIC, checkpoint_epoch_id, num_vertices, recycled_vertices.size(), 0, WAL_CHECKSUM_SEED};
+    std::string buffer;
+    size_t offset = sizeof(header);
+    auto flush = [&]() {
+        if (pwrite(fd, buffer.data(), buffer.size(), offset) != (ssize_t)buffer.size())
+            throw std::runtime_error("write checkpoint file error.");
+        header.checksum = wal_checksum(buffer, header.checksum);
+        offset += buffer.size();
+        buffer.clear();
+    };
 
-        // Compact EdgeBlock
+    try
+    {
+        for (vertex_t vid = 0; vid < num_vertices; vid++)
         {
-            auto edge_label_pointer = edge_label_ptrs[vid];
-            auto edge_label_block = block_manager.convert<EdgeLabelBlockHeader>(edge_label_pointer);
-            if (edge_label_block)
+            auto data = txn.get_vertex(vid);
+            if (!data.empty())
             {
-                for (size_t i = 0; i < edge_label_block->get_num_entries(); i++)
+                wal_append(buffer, OPType::PutVertex);
+                wal_append(buffer, vid);
+                wal_append(buffer, data);
+            }
+
+            auto edge_label_block = block_manager.convert<EdgeLabelBlockHeader>(edge_label_ptrs[vid]);
+            for (size_t i = 0; edge_label_block && i < edge_label_block->get_num_entries(); i++)
+            {
+                auto label = edge_label_block->get_entries()[i].get_label();
+                // oldest first, so that the replayed edge blocks keep the scan order
+                for (auto iter = txn.get_edges(vid, label, true); iter.valid(); iter.next())
                 {
-                    auto &label_entry = edge_label_block->get_entries()[i];
-                    auto pointer = label_entry.get_pointer();
-                    auto edge_block = block_manager.convert<EdgeBlockHeader>(pointer);
-                    if (!edge_block)
-                        continue;
-                    compact_n2o_blocks(pointer);
-
-                    size_t new_num_entries = 0;
-                    size_t new_data_length = 0;
-
-                    // Scan deleted edges
-                    auto entries = edge_block->get_entries();
-                    auto data = edge_block->get_data();
-                    auto num_entries = edge_block->get_num_entries();
-                    for (size_t i = 0; i < num_entries; i++)
-                    {
-                        entries--;
-                        if (cmp_timestamp(entries->get_deletion_time_pointer(), read_epoch_id) > 0)
-                        {
-                            new_num_entries++;
-                            new_data_length += entries->get_length();
-                        }
-                    }
-                    entries = edge_block->get_entries(); // Reset cursor
+                    wal_append(buffer, OPType::PutEdge);
+                    wal_append(buffer, vid);
+                    wal_append(buffer, label);
+                    wal_append(buffer, iter.dst_id());
+                    wal_append(buffer, true);
+                    wal_append(buffer, iter.edge_data());
+                }
+            }
 
-                    if (new_num_entries == num_entries)
-                        continue;
+            if (buffer.size() >= CHECKPOINT_BUFFER_SIZE)
+                flush();
+        }
+        flush();
+        header.length = offset - sizeof(header);
+        buffer.append(reinterpret_cast<char *>(recycled_vertices.data()), recycled_vertices.size() * sizeof(vertex_t));
+        flush();
 
-                    // Copy a new edge block
-                    need_future_compact = true;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+            throw std::runtime_error("write checkpoint file error.");
+        if (fsync(fd) != 0)
+            throw std::runtime_error("fsync checkpoint file error.");
+    }
+    catch (...)
+    {
+        close(fd);
+        unlink(tmp_path.c_str());
+        throw;
+    }
+    close(fd);
 
-                    auto size = sizeof(EdgeBlockHeader) + new_num_entries * sizeof(EdgeEntry) + new_data_length;
-                    auto order = size_to_order(size);
+    if (rename(tmp_path.c_str(), checkpoint_path.c_str()) != 0)
+    {
+        unlink(tmp_path.c_str());
+        throw std::runtime_error("rename checkpoint file error.");
+    }
+    auto slash = checkpoint_path.rfind('/');
+    auto dir_path = slash == std::string::npos ? "." : checkpoint_path.substr(0, slash + 1);
+    int dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
 
-                    if (order > edge_block->BLOOM_FILTER_PORTION &&
-                        size + (1ul << (order - edge_block->BLOOM_FILTER_PORTION)) >=
-                            (1ul << edge_block->BLOOM_FILTER_THRESHOLD))
-                    {
-                        size += 1ul << (order - edge_block->BLOOM_FILTER_PORTION);
-                    }
-                    order = size_to_order(size);
+    commit_manager.truncate(checkpoint_epoch_id);
 
-                    auto new_pointer = block_manager.alloc(order);
+    return checkpoint_epoch_id;
+}
+
+// Operations are partitioned by vertex, so every partition replays its
+// vertices in commit order without synchronizing with other partitions.
+class Graph::Replayer
+{
+public:
+    Replayer(Graph &_graph)
+        : recycled_vertices(), graph(_graph), partitions(RECOVERY_PARTITIONS), num_pending_ops(0)
+    {
+    }
 
-                    auto new_edge_block = block_manager.convert<EdgeBlockHeader>(new_pointer);
-                    new_edge_block->fill(order, vid, read_epoch_id, pointer, edge_block->get_committed_time());
+    void add_group(const WALGroupHeader &header, std::string_view txns)
+    {
+        WALReader reader(txns);
+        for (size_t i = 0; i < header.num_txns; i++)
+            reader.read_transaction([&](const WALOperation &op) { add_operation(header.epoch_id, op); });
+    }
+
+    void add_operation(timestamp_t write_epoch_id, const WALOperation &op)
+    {
+        // vertices loaded by batch loaders are not logged, so ids are also
+        // recovered from the endpoints of edges
+        auto max_vid = std::max(op.src, op.dst);
+        if (max_vid >= graph.max_vertex_id)
+            throw std::runtime_error("recover wal error.");
+        if (max_vid >= graph.vertex_id.load(std::memory_order_relaxed))
+        {
+            graph.grow_vertices(max_vid + 1);
+            graph.vertex_id.store(max_vid + 1, std::memory_order_release);
+        }
+        if (op.type == OPType::NewVertex)
+            recycled_vertices.erase(op.src);
+        else if (op.type == OPType::DelVertex && op.flag)
+            recycled_vertices.emplace(op.src);
+        partitions[op.src % RECOVERY_PARTITIONS].emplace_back(write_epoch_id, op);
+        if (++num_pending_ops >= RECOVERY_BATCH_SIZE)
+            replay();
+    }
 
-                    auto bloom_filter = new_edge_block->get_bloom_filter();
-                    for (size_t i = 0; i < num_entries; i++)
+    void replay()
+    {
+        tbb::parallel_for(size_t(0), partitions.size(), [&](size_t i) {
+            auto &ops = partitions[i];
+            size_t j = 0;
+            while (j < ops.size())
+            {
+                auto write_epoch_id = ops[j].first;
+                Transaction txn(graph, RO_TRANSACTION, write_epoch_id, true, false, Durability::None);
+                for (; j < ops.size() && ops[j].first == write_epoch_id; j++)
+                {
+                    const auto &op = ops[j].second;
+                    switch (op.type)
                     {
-                        entries--;
-                        if (cmp_timestamp(entries->get_deletion_time_pointer(), read_epoch_id) > 0)
-                            new_edge_block->append(*entries, data, bloom_filter);
-                        data += entries->get_length();
+                    case OPType::NewVertex:
+                        // a recycled id, whose old versions readers may still be on
+                        graph.vertex_futexes[op.src].clear();
+                        graph.retire_vertex(op.src);
+                        break;
+                    case OPType::PutVertex:
+                        txn.put_vertex(op.src, op.data);
+                        break;
+                    case OPType::DelVertex:
+                        txn.del_vertex(op.src);
+                        break;
+                    case OPType::PutEdge:
+                        txn.put_edge(op.src, op.label, op.dst, op.data, op.flag);
+                        break;
+                    case OPType::DelEdge:
+                        txn.del_edge(op.src, op.label, op.dst);
+                        break;
                     }
+                }
+            }
+            ops.clear();
+        });
+        num_pending_ops = 0;
+    }
 
-                    label_entry.set_pointer(new_pointer);
+    // Returns the epoch of the checkpoint, or epoch_id without one.
+    timestamp_t load_checkpoint(const std::string &path, timestamp_t epoch_id)
+    {
+        auto image = map_file(path);
+        if (!image.empty())
+        {
+            CheckpointHeader header;
+            if (image.size() < sizeof(header))
+                throw std::runtime_error("read checkpoint file error.");
+            memcpy(&header, image.data(), sizeof(header));
+            auto body = image.substr(sizeof(header));
+            if (header.magic != CHECKPOINT_MAGIC || header.length > body.size() ||
+                body.size() - header.length != header.num_recycled_vertices * sizeof(vertex_t) ||
+                header.checksum != wal_checksum(body) || header.num_vertices > graph.max_vertex_id)
+                throw std::runtime_error("read checkpoint file error.");
+            auto ops = body.substr(0, header.length);
 
-                    // printf("Compact %lu edges, %lu data\n",
-                    // num_entries-new_num_entries,
-                    // edge_block->get_data_length()-new_data_length);
-                }
+            graph.grow_vertices(header.num_vertices);
+            graph.vertex_id.store(header.num_vertices, std::memory_order_relaxed);
+            WALReader reader(ops);
+            while (!reader.empty())
+                add_operation(header.epoch_id, reader.read_operation());
+            replay();
+            for (size_t i = 0; i < header.num_recycled_vertices; i++)
+            {
+                vertex_t vid;
+                memcpy(&vid, body.data() + header.length + i * sizeof(vertex_t), sizeof(vid));
+                recycled_vertices.emplace(vid);
             }
+
+            epoch_id = header.epoch_id;
         }
+        unmap_file(image);
+        return epoch_id;
+    }
 
-        if (need_future_compact)
-            new_compact_table.emplace(vid);
-        vertex_futexes[vid].unlock();
+    std::unordered_set<vertex_t> recycled_vertices;
+
+private:
+    Graph &graph;
+    std::vector<std::vector<std::pair<timestamp_t, WALOperation>>> partitions;
+    size_t num_pending_ops;
+};
+
+// A block file closed cleanly keeps the graph as
+// [GraphMetadata][vertex_ptrs][edge_label_ptrs][recycled vertex ids]
+struct GraphMetadata
+{
+    timestamp_t epoch_id;
+    vertex_t num_vertices;
+    size_t num_recycled_vertices;
+};
+
+void Graph::save()
+{
+    std::vector<vertex_t> recycled_vertices;
+    vertex_t vid = 0;
+    while (recycled_vertex_ids.try_pop(vid))
+        recycled_vertices.emplace_back(vid);
+
+    GraphMetadata header{epoch_id.load(), vertex_id.load(), recycled_vertices.size()};
+    std::string metadata(reinterpret_cast<char *>(&header), sizeof(header));
+    metadata.reserve(sizeof(header) + 2 * header.num_vertices * sizeof(uintptr_t) +
+                     recycled_vertices.size() * sizeof(vertex_t));
+    for (vertex_t vid = 0; vid < header.num_vertices; vid++)
+        metadata.append(reinterpret_cast<char *>(&vertex_ptrs[vid]), sizeof(uintptr_t));
+    for (vertex_t vid = 0; vid < header.num_vertices; vid++)
+        metadata.append(reinterpret_cast<char *>(&edge_label_ptrs[vid]), sizeof(uintptr_t));
+    metadata.append(reinterpret_cast<char *>(recycled_vertices.data()), recycled_vertices.size() * sizeof(vertex_t));
+    block_manager.set_metadata(std::move(metadata));
+}
+
+bool Graph::restore()
+{
+    auto metadata = block_manager.get_metadata();
+    if (metadata.empty())
+        return false;
+    GraphMetadata header;
+    if (metadata.size() < sizeof(header))
+        throw std::runtime_error("read block metadata error.");
+    memcpy(&header, metadata.data(), sizeof(header));
+    if (header.num_vertices > max_vertex_id ||
+        metadata.size() != sizeof(header) + 2 * header.num_vertices * sizeof(uintptr_t) +
+                               header.num_recycled_vertices * sizeof(vertex_t))
+        throw std::runtime_error("read block metadata error.");
+
+    auto p = metadata.data() + sizeof(header);
+    grow_vertices(header.num_vertices);
+    for (vertex_t vid = 0; vid < header.num_vertices; vid++, p += sizeof(uintptr_t))
+        memcpy(&vertex_ptrs[vid], p, sizeof(uintptr_t));
+    for (vertex_t vid = 0; vid < header.num_vertices; vid++, p += sizeof(uintptr_t))
+        memcpy(&edge_label_ptrs[vid], p, sizeof(uintptr_t));
+    for (size_t i = 0; i < header.num_recycled_vertices; i++, p += sizeof(vertex_t))
+    {
+        vertex_t vid;
+        memcpy(&vid, p, sizeof(vid));
+        recycled_vertex_ids.push(vid);
     }
 
-    compact_table.local().swap(new_compact_table);
+    // the stats and the dirty set are rebuilt from the blocks
+    tbb::parallel_for(tbb::blocked_range<vertex_t>(0, header.num_vertices, COMPACT_GRAIN_SIZE),
+                      [&](const tbb::blocked_range<vertex_t> &range) {
+                          for (auto vid = range.begin(); vid != range.end(); vid++)
+                              count_vertex(vid);
+                      });
 
-    // printf("Compact %lu bytes blocks\n", recycled_block_size);
+    vertex_id.store(header.num_vertices, std::memory_order_relaxed);
+    epoch_id.store(header.epoch_id, std::memory_order_relaxed);
+    block_manager.set_metadata(std::string());
+    return true;
+}
 
-    return read_epoch_id;
+void Graph::recover()
+{
+    // a reopened block file is newer than the checkpoint, and only groups
+    // after it are replayed
+    Replayer replayer(*this);
+    auto checkpoint_epoch_id =
+        restore() ? epoch_id.load() : replayer.load_checkpoint(checkpoint_path, epoch_id.load());
+
+    auto recovered_epoch_id = commit_manager.recover(
+        checkpoint_epoch_id,
+        [&](const WALGroupHeader &header, std::string_view txns) { replayer.add_group(header, txns); },
+        [&]() { replayer.replay(); });
+
+    for (auto vid : replayer.recycled_vertices)
+        recycled_vertex_ids.push(vid);
+
+    epoch_id.store(recovered_epoch_id, std::memory_order_release);
+}
+
+void Graph::follow(std::string primary_wal_path)
+{
+    if (!checkpoint_path.empty() || is_follower)
+        throw std::invalid_argument("The graph should have no WAL to follow another.");
+    if (epoch_id.load() != 0 || vertex_id.load() != 0)
+        throw std::invalid_argument("The graph should be empty to follow another.");
+    if (access((primary_wal_path + "/1").c_str(), F_OK) == 0)
+        throw std::invalid_argument("Following a WAL with multiple streams is not supported.");
+
+    auto replayer = std::make_shared<Replayer>(*this);
+    auto checkpoint_epoch_id = replayer->load_checkpoint(primary_wal_path + "/checkpoint", 0);
+    epoch_id.store(checkpoint_epoch_id, std::memory_order_release);
+    auto tail = std::make_shared<WALTail>(primary_wal_path, checkpoint_epoch_id);
+
+    auto poll = [this, replayer, tail]() {
+        timestamp_t replayed_epoch_id = 0;
+        auto num_groups = tail->poll(
+            [&](const WALGroupHeader &header, std::string_view txns) {
+                replayer->add_group(header, txns);
+                replayed_epoch_id = header.epoch_id;
+            },
+            [&]() { replayer->replay(); });
+        if (num_groups)
+        {
+            replayer->replay();
+            epoch_id.store(replayed_epoch_id, std::memory_order_release);
+        }
+        return num_groups;
+    };
+    if (poll())
+        compact();
+    if (tail->is_lost())
+        throw std::runtime_error("follow wal error.");
+
+    is_follower = true;
+    following.store(true);
+    // the replayed versions are compacted like those of transactions, up to
+    // the oldest reader of the follower
+    follower_thread = std::thread([this, poll, tail]() {
+        auto last_compaction_time = std::chrono::steady_clock::now();
+        while (following.load() && !tail->is_lost())
+        {
+            bool replayed = poll();
+            // also from time to time when idle, for the versions readers
+            // were still on
+            auto now = std::chrono::steady_clock::now();
+            if (replayed || now - last_compaction_time >= FOLLOW_COMPACTION_INTERVAL)
+            {
+                compact();
+                last_compaction_time = now;
+            }
+            if (!replayed)
+                std::this_thread::sleep_for(FOLLOW_INTERVAL);
+        }
+        following.store(false);
+    });
 }
@@ -32,7 +32,12 @@ vertex_t Transaction::new_vertex(bool use_recycled_vertex)
     }
     else if (!use_recycled_vertex || (!graph.recycled_vertex_ids.try_pop(vertex_id)))
     {
-        vertex_id = graph.vertex_id.fetch_add(1, std::memory_order_relaxed);
+        // the arrays grow before the id is released to readers
+        vertex_id = graph.vertex_id.load(std::memory_order_relaxed);
+        do
+            graph.grow_vertices(vertex_id + 1);
+        while (!graph.vertex_id.compare_exchange_weak(vertex_id, vertex_id + 1, std::memory_order_release,
+                                                      std::memory_order_relaxed));
     }
     graph.vertex_futexes[vertex_id].clear();
     graph.vertex_ptrs[vertex_id] = graph.block_manager.NULLPOINTER;
@@ -41,9 +46,7 @@ vertex_t Transaction::new_vertex(bool use_recycled_vertex)
     if (!batch_update)
     {
         new_vertex_cache.emplace_back(vertex_id);
-        ++wal_num_ops();
-        wal_append(OPType::NewVertex);
-        wal_append(vertex_id);
+        wal_log(OPType::NewVertex, vertex_id);
     }
 
     return vertex_id;
@@ -76,12 +79,13 @@ void Transaction::put_vertex(vertex_t vertex_id, std::string_view data)
 
     auto size = sizeof(VertexBlockHeader) + data.size();
     auto order = size_to_order(size);
-    auto pointer = graph.block_manager.alloc(order);
+    auto pointer = graph.alloc_block(order, vertex_id);
 
     auto vertex_block = graph.block_manager.convert<VertexBlockHeader>(pointer);
     vertex_block->fill(order, vertex_id, write_epoch_id, prev_pointer, data.data(), data.size());
+    graph.count_block(pointer, 1);
 
-    graph.compact_table.local().emplace(vertex_id);
+    graph.mark_dirty(vertex_id);
 
     if (batch_update)
     {
@@ -94,10 +98,7 @@ void Transaction::put_vertex(vertex_t vertex_id, std::string_view data)
         timestamps_to_update.emplace_back(vertex_block->get_creation_time_pointer(), Graph::ROLLBACK_TOMBSTONE);
         vertex_ptr_cache[vertex_id] = pointer;
 
-        ++wal_num_ops();
-        wal_append(OPType::PutVertex);
-        wal_append(vertex_id);
-        wal_append(data);
+        wal_log(OPType::PutVertex, vertex_id, data);
     }
 }
 
@@ -133,14 +134,19 @@ bool Transaction::del_vertex(vertex_t vertex_id, bool recycle)
         ret = true;
         auto size = sizeof(VertexBlockHeader);
         auto order = size_to_order(size);
-        auto pointer = graph.block_manager.alloc(order);
+        auto pointer = graph.alloc_block(order, vertex_id);
 
         auto vertex_block = graph.block_manager.convert<VertexBlockHeader>(pointer);
         vertex_block->fill(order, vertex_id, write_epoch_id, prev_pointer, nullptr, vertex_block->TOMBSTONE);
+        graph.count_block(pointer, 1);
 
-        graph.compact_table.local().emplace(vertex_id);
+        graph.mark_dirty(vertex_id);
 
-        if (!batch_update)
+        if (batch_update)
+        {
+            graph.vertex_ptrs[vertex_id] = pointer;
+        }
+        else
         {
             block_cache.emplace_back(pointer, order);
             timestamps_to_update.emplace_back(vertex_block->get_creation_time_pointer(), Graph::ROLLBACK_TOMBSTONE);
@@ -156,10 +162,7 @@ bool Transaction::del_vertex(vertex_t vertex_id, bool recycle)
     }
     else
     {
-        ++wal_num_ops();
-        wal_append(OPType::DelVertex);
-        wal_append(vertex_id);
-        wal_append(recycle);
+        wal_log(OPType::DelVertex, vertex_id, recycle);
 
         if (recycle)
             recycled_vertex_cache.emplace_back(vertex_id);
@@ -172,7 +175,7 @@ std::string_view Transaction::get_vertex(vertex_t vertex_id)
 {
     check_valid();
 
-    if (vertex_id >= graph.vertex_id.load(std::memory_order_relaxed))
+    if (vertex_id >= graph.vertex_id.load(std::memory_order_acquire))
         return std::string_view();
 
     uintptr_t pointer;
@@ -238,6 +241,7 @@ Transaction::find_edge(vertex_t dst, EdgeBlockHeader *edge_block, size_t num_ent
 
 uintptr_t Transaction::locate_edge_block(vertex_t src, label_t label)
 {
+    graph.touch_vertex(src);
     auto pointer = graph.edge_label_ptrs[src];
     if (pointer == graph.block_manager.NULLPOINTER)
         return pointer;
@@ -312,10 +316,11 @@ void Transaction::update_edge_label_block(vertex_t src, label_t label, uintptr_t
         auto size = sizeof(EdgeLabelBlockHeader) + (1 + num_entries) * sizeof(EdgeLabelEntry);
         auto order = size_to_order(size);
 
-        auto new_pointer = graph.block_manager.alloc(order);
+        auto new_pointer = graph.alloc_block(order, src);
 
         auto new_edge_label_block = graph.block_manager.convert<EdgeLabelBlockHeader>(new_pointer);
         new_edge_label_block->fill(order, src, write_epoch_id, pointer);
+        graph.count_block(new_pointer, 1);
 
         if (!batch_update)
         {
@@ -388,10 +393,11 @@ void Transaction::put_edge(vertex_t src, label_t label, vertex_t dst, std::strin
         }
         order = size_to_order(size);
 
-        auto new_pointer = graph.block_manager.alloc(order);
+        auto new_pointer = graph.alloc_block(order, src);
 
         auto new_edge_block = graph.block_manager.convert<EdgeBlockHeader>(new_pointer);
         new_edge_block->fill(order, src, write_epoch_id, pointer, write_epoch_id);
+        graph.count_block(new_pointer, 1);
 
         if (!batch_update)
         {
@@ -417,6 +423,10 @@ void Transaction::put_edge(vertex_t src, label_t label, vertex_t dst, std::strin
                     if (!batch_update && edge->get_creation_time() == -local_txn_id)
                         timestamps_to_update.emplace_back(edge->get_creation_time_pointer(), Graph::ROLLBACK_TOMBSTONE);
                 }
+                else
+                {
+                    count_deleted_edges(-1);
+                }
                 data += entries->get_length();
             }
         }
@@ -436,6 +446,7 @@ void Transaction::put_edge(vertex_t src, label_t label, vertex_t dst, std::strin
         if (prev_edge.first)
         {
             prev_edge.first->set_deletion_time(write_epoch_id);
+            count_deleted_edges(1);
             if (!batch_update)
                 timestamps_to_update.emplace_back(prev_edge.first->get_deletion_time_pointer(),
                                                   Graph::ROLLBACK_TOMBSTONE);
@@ -447,7 +458,7 @@ void Transaction::put_edge(vertex_t src, label_t label, vertex_t dst, std::strin
     if (!batch_update)
         timestamps_to_update.emplace_back(edge->get_creation_time_pointer(), Graph::ROLLBACK_TOMBSTONE);
 
-    graph.compact_table.local().emplace(src);
+    graph.mark_dirty(src);
 
     if (batch_update)
     {
@@ -456,13 +467,7 @@ void Transaction::put_edge(vertex_t src, label_t label, vertex_t dst, std::strin
     else
     {
         edge_ptr_cache[std::make_pair(src, label)] = pointer;
-        ++wal_num_ops();
-        wal_append(OPType::PutEdge);
-        wal_append(src);
-        wal_append(label);
-        wal_append(dst);
-        wal_append(force_insert);
-        wal_append(edge_data);
+        wal_log(OPType::PutEdge, src, label, dst, force_insert, edge_data);
     }
 }
 
@@ -506,11 +511,12 @@ bool Transaction::del_edge(vertex_t src, label_t label, vertex_t dst)
     if (edge.first)
     {
         edge.first->set_deletion_time(write_epoch_id);
+        count_deleted_edges(1);
         if (!batch_update)
             timestamps_to_update.emplace_back(edge.first->get_deletion_time_pointer(), Graph::ROLLBACK_TOMBSTONE);
     }
 
-    graph.compact_table.local().emplace(src);
+    graph.mark_dirty(src);
 
     if (batch_update)
     {
@@ -522,11 +528,7 @@ bool Transaction::del_edge(vertex_t src, label_t label, vertex_t dst)
         // make sure commit will change committed_time
         set_num_entries_data_length_cache(edge_block, num_entries, data_length);
 
-        ++wal_num_ops();
-        wal_append(OPType::DelEdge);
-        wal_append(src);
-        wal_append(label);
-        wal_append(dst);
+        wal_log(OPType::DelEdge, src, label, dst);
     }
 
     if (edge.first != nullptr)
@@ -539,7 +541,7 @@ std::string_view Transaction::get_edge(vertex_t src, label_t label, vertex_t dst
 {
     check_valid();
 
-    if (src >= graph.vertex_id.load(std::memory_order_relaxed))
+    if (src >= graph.vertex_id.load(std::memory_order_acquire))
         return std::string_view();
 
     uintptr_t pointer;
@@ -591,6 +593,7 @@ void Transaction::abort()
 
     for (const auto &p : block_cache)
     {
+        graph.count_block(p.first, -1);
         graph.block_manager.free(p.first, p.second);
     }
 
@@ -601,7 +604,7 @@ EdgeIterator Transaction::get_edges(vertex_t src, label_t label, bool reverse)
 {
     check_valid();
 
-    if (src >= graph.vertex_id.load(std::memory_order_relaxed))
+    if (src >= graph.vertex_id.load(std::memory_order_acquire))
         return EdgeIterator(nullptr, nullptr, 0, 0, read_epoch_id, local_txn_id, reverse);
 
     uintptr_t pointer;
@@ -634,6 +637,49 @@ EdgeIterator Transaction::get_edges(vertex_t src, label_t label, bool reverse)
                         local_txn_id, reverse);
 }
 
+std::vector<EdgeIterator> Transaction::get_edges_batch(const std::vector<std::pair<vertex_t, label_t>> &edges,
+                                                       bool reverse)
+{
+    check_valid();
+
+    auto num_vertices = graph.vertex_id.load(std::memory_order_acquire);
+    for (auto [src, label] : edges)
+    {
+        if (src < num_vertices && graph.edge_label_ptrs[src] != graph.block_manager.NULLPOINTER)
+            graph.block_manager.prefetch(graph.edge_label_ptrs[src],
+                                         sizeof(EdgeLabelBlockHeader) + sizeof(EdgeLabelEntry));
+    }
+
+    std::vector<uintptr_t> pointers;
+    pointers.reserve(edges.size());
+    for (auto [src, label] : edges)
+    {
+        auto pointer = src < num_vertices ? locate_edge_block(src, label) : graph.block_manager.NULLPOINTER;
+        if (pointer != graph.block_manager.NULLPOINTER)
+            graph.block_manager.prefetch(pointer, sizeof(EdgeBlockHeader));
+        pointers.push_back(pointer);
+    }
+
+    for (auto pointer : pointers)
+    {
+        auto edge_block = graph.block_manager.convert<EdgeBlockHeader>(pointer);
+        if (!edge_block)
+            continue;
+        auto base = reinterpret_cast<char *>(edge_block);
+        auto num_entries = edge_block->get_num_entries();
+        auto entries = reinterpret_cast<char *>(edge_block->get_entries() - num_entries);
+        graph.block_manager.prefetch(pointer + (entries - base), num_entries * sizeof(EdgeEntry));
+        graph.block_manager.prefetch(pointer + (edge_block->get_data() - base), edge_block->get_data_length());
+    }
+
+    // the blocks are located again, from the cache now
+    std::vector<EdgeIterator> iterators;
+    iterators.reserve(edges.size());
+    for (auto [src, label] : edges)
+        iterators.push_back(get_edges(src, label, reverse));
+    return iterators;
+}
+
 timestamp_t Transaction::commit(bool wait_visable)
 {
     check_valid();
@@ -642,7 +688,7 @@ timestamp_t Transaction::commit(bool wait_visable)
     if (batch_update)
         return read_epoch_id;
 
-    auto [commit_epoch_id, num_unfinished] = graph.commit_manager.register_commit(wal);
+    auto [commit_epoch_id, num_unfinished] = graph.commit_manager.register_commit(wal, durability);
 
     for (const auto &p : vertex_ptr_cache)
     {
@@ -677,6 +723,7 @@ timestamp_t Transaction::commit(bool wait_visable)
     {
         *p.first = commit_epoch_id;
     }
+    graph.count_deleted_edges(num_deleted_edges);
 
     clean();
 
@@ -28,3 +28,15 @@ TEST_CASE("testing the SparseArrayAllocator")
     auto int_data = allocator_for_int.allocate(1000);
     allocator_for_int.deallocate(int_data, 1000);
 }
+
+TEST_CASE("testing the SparseArrayAllocator: huge pages")
+{
+    SparseArrayAllocator<void> allocator(HugePages::Transparent);
+    auto allocator_for_int = std::allocator_traits<decltype(allocator)>::rebind_alloc<int>(allocator);
+    CHECK(allocator_for_int.huge_pages == HugePages::Transparent);
+    CHECK(allocator_for_int != SparseArrayAllocator<int>());
+    auto int_data = allocator_for_int.allocate(1ul << 20);
+    int_data[(1ul << 20) - 1] = 1;
+    allocator_for_int.deallocate(int_data, 1ul << 20);
+    CHECK(huge_page_size() % 4096 == 0);
+}
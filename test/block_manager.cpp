@@ -15,6 +15,17 @@
 
 #include <doctest/doctest.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
 #include "blocks.cpp"
 #include "core/block_manager.hpp"
 #include "core/utils.hpp"
@@ -36,3 +47,276 @@ TEST_CASE("testing the BlockManager")
 
     CHECK(manager.convert<char>(manager.NULLPOINTER) == nullptr);
 }
+
+TEST_CASE("testing the BlockManager: buddies")
+{
+    BlockManager manager("");
+    const size_t chunk = 1ul << 20;
+    CHECK(manager.stats().used_size == chunk);
+
+    // blocks too large to be cached by threads are merged right away
+    auto a = manager.alloc(17);
+    auto b = manager.alloc(17);
+    CHECK(a == chunk);
+    CHECK(b == a + (1ul << 17));
+    manager.free(a, 17);
+    manager.free(b, 17);
+    auto stats = manager.stats();
+    CHECK(stats.used_size == 2 * chunk);
+    CHECK(stats.free_size == chunk);
+    CHECK(stats.free_chunk_size == chunk);
+    CHECK(stats.fragmentation() == 0.0);
+    CHECK(manager.alloc(20) == chunk);
+
+    std::vector<uintptr_t> blocks;
+    for (size_t i = 0; i < 4; i++)
+        blocks.push_back(manager.alloc(18));
+    CHECK(blocks[0] == 2 * chunk);
+    manager.free(blocks[1], 18);
+    manager.free(blocks[3], 18);
+    stats = manager.stats();
+    CHECK(stats.free_size == 1ul << 19);
+    CHECK(stats.free_chunk_size == 0);
+    CHECK(stats.fragmentation() == 1.0);
+
+    // all the space of small blocks comes back once they are freed
+    std::mt19937 gen(0);
+    std::vector<std::pair<uintptr_t, order_t>> allocated;
+    for (size_t round = 0; round < 4; round++)
+    {
+        for (size_t i = 0; i < 10000; i++)
+        {
+            order_t order = 5 + gen() % 10;
+            allocated.emplace_back(manager.alloc(order), order);
+        }
+        std::shuffle(allocated.begin(), allocated.end(), gen);
+        for (size_t i = 0; i < allocated.size() / 2; i++)
+            manager.free(allocated[i].first, allocated[i].second);
+        allocated.erase(allocated.begin(), allocated.begin() + allocated.size() / 2);
+    }
+    std::sort(allocated.begin(), allocated.end());
+    for (size_t i = 1; i < allocated.size(); i++)
+        CHECK(allocated[i - 1].first + (1ul << allocated[i - 1].second) <= allocated[i].first);
+    for (auto [pointer, order] : allocated)
+    {
+        CHECK(pointer % (1ul << order) == 0);
+        manager.free(pointer, order);
+    }
+    manager.free(blocks[0], 18);
+    manager.free(blocks[2], 18);
+    manager.free(chunk, 20);
+    stats = manager.stats();
+    CHECK(stats.free_size == stats.used_size - chunk);
+
+    // so are blocks larger than a chunk, which serve the next order
+    BlockManager large_manager("");
+    auto c = large_manager.alloc(21);
+    auto d = large_manager.alloc(21);
+    CHECK(d == c + 2 * chunk);
+    large_manager.free(c, 21);
+    large_manager.free(d, 21);
+    stats = large_manager.stats();
+    CHECK(stats.free_sizes[21] == 0);
+    CHECK(stats.free_sizes[22] == 4 * chunk);
+    CHECK(large_manager.alloc(22) == c);
+    CHECK(large_manager.stats().used_size == stats.used_size);
+    // and are split for smaller ones
+    large_manager.free(c, 22);
+    CHECK(large_manager.alloc(20) == c);
+    CHECK(large_manager.alloc(21) == c + 2 * chunk);
+    CHECK(large_manager.alloc(20) == c + chunk);
+    CHECK(large_manager.stats().used_size == stats.used_size);
+}
+
+TEST_CASE("testing the BlockManager: magazines")
+{
+    BlockManager manager("");
+    const order_t order = 6;
+    const size_t num_blocks = 1ul << 12;
+
+    // blocks freed by one thread are reused by others through the depot,
+    // even after the freeing thread exits
+    std::vector<uintptr_t> blocks;
+    std::thread([&]() {
+        for (size_t i = 0; i < num_blocks; i++)
+            blocks.push_back(manager.alloc(order));
+    }).join();
+    auto used_size = manager.stats().used_size;
+    std::thread([&]() {
+        for (auto pointer : blocks)
+            manager.free(pointer, order);
+    }).join();
+    CHECK(manager.stats().free_size >= num_blocks << order);
+
+    std::sort(blocks.begin(), blocks.end());
+    for (size_t t = 0; t < 2; t++)
+    {
+        std::thread([&]() {
+            for (size_t i = 0; i < num_blocks / 2; i++)
+            {
+                auto pointer = manager.alloc(order);
+                CHECK(std::binary_search(blocks.begin(), blocks.end(), pointer));
+            }
+        }).join();
+    }
+    CHECK(manager.stats().used_size == used_size);
+}
+
+TEST_CASE("testing the BlockManager: trim")
+{
+    const std::string path = "./blocks";
+    for (auto block_path : {std::string(), path})
+    {
+        BlockManager manager(block_path, 1ul << 32);
+        const size_t chunk = 1ul << 20;
+        std::vector<uintptr_t> chunks;
+        for (size_t i = 0; i < 4; i++)
+        {
+            chunks.push_back(manager.alloc(20));
+            memset(manager.convert<char>(chunks.back()), 1, chunk);
+        }
+        struct stat st = {};
+        if (!block_path.empty())
+            CHECK(stat(path.c_str(), &st) == 0);
+        auto disk_size = st.st_blocks;
+
+        manager.free(chunks[0], 20);
+        manager.free(chunks[2], 20);
+        manager.set_trim_threshold(4 * chunk);
+        CHECK(manager.trim() == 0);
+        CHECK(manager.trim(true) == 2 * chunk);
+        CHECK(manager.trim(true) == 0);
+        auto stats = manager.stats();
+        CHECK(stats.trimmed_size == 2 * chunk);
+        CHECK(stats.num_trims == 2);
+        CHECK(stats.free_size == 2 * chunk);
+        CHECK(manager.convert<char>(chunks[0])[0] == 0);
+        CHECK(manager.convert<char>(chunks[1])[0] == 1);
+        if (!block_path.empty())
+        {
+            CHECK(stat(path.c_str(), &st) == 0);
+            CHECK(st.st_blocks < disk_size);
+        }
+
+        CHECK(manager.alloc(20) == chunks[0]);
+        CHECK(manager.stats().trimmed_size == chunk);
+    }
+    CHECK(std::remove(path.c_str()) == 0);
+}
+
+TEST_CASE("testing the BlockManager: huge pages")
+{
+    {
+        BlockManager manager("", 1ul << 32, HugePages::Transparent);
+        auto pointer = manager.alloc(20);
+        memset(manager.convert<char>(pointer), 1, 1ul << 20);
+        manager.free(pointer, 20);
+    }
+
+    const std::string path = "./blocks";
+    CHECK_THROWS_AS(BlockManager(path, 1ul << 32, HugePages::Explicit), std::invalid_argument);
+    CHECK(std::remove(path.c_str()) == 0);
+}
+
+TEST_CASE("testing the BlockManager: NUMA")
+{
+    BlockManager manager("", 1ul << 32, HugePages::None, true);
+    CHECK(manager.num_nodes() == numa_topology().num_nodes());
+    auto partition_size = (1ul << 32) / manager.num_nodes();
+    for (size_t node = 0; node < manager.num_nodes(); node++)
+    {
+        auto pointer = manager.alloc(6, node);
+        CHECK(pointer / partition_size == node);
+        *manager.convert<char>(pointer) = 1;
+        manager.free(pointer, 6);
+        // cached by the thread, whatever node it runs on
+        CHECK(manager.alloc(6, node) == pointer);
+        manager.free(pointer, 6);
+        pointer = manager.alloc(21, node);
+        CHECK(pointer / partition_size == node);
+        manager.free(pointer, 21);
+    }
+    CHECK(manager.alloc(6) != manager.NULLPOINTER);
+
+    const std::string path = "./blocks";
+    CHECK_THROWS_AS(BlockManager(path, 1ul << 32, HugePages::None, true), std::invalid_argument);
+}
+
+TEST_CASE("testing the BlockManager: tiers")
+{
+    const std::string cold_path = "./cold_blocks";
+    {
+        BlockManager manager("", 1ul << 32, HugePages::None, false, cold_path);
+        CHECK(manager.tiered());
+        CHECK(!manager.persistent());
+        auto hot_pointer = manager.alloc(6);
+        CHECK(!manager.is_cold(hot_pointer));
+        auto pointer = manager.alloc_cold(6);
+        CHECK(manager.is_cold(pointer));
+        strcpy(manager.convert<char>(pointer), "cold");
+        CHECK(std::string(manager.convert<char>(pointer)) == "cold");
+        // evicted blocks are read back from the file
+        manager.evict(pointer, 1ul << 6);
+        CHECK(std::string(manager.convert<char>(pointer)) == "cold");
+        auto large_pointer = manager.alloc_cold(21);
+        CHECK(manager.is_cold(large_pointer));
+        CHECK(manager.stats().cold_used_size == 3ul << 20);
+
+        // freed cold blocks are reused by the cold tier only
+        manager.free(pointer, 6);
+        CHECK(!manager.is_cold(manager.alloc(6)));
+        CHECK(manager.alloc_cold(6) == pointer);
+        manager.free(large_pointer, 21);
+        CHECK(manager.trim(true) == 1ul << 21);
+    }
+    CHECK(std::remove(cold_path.c_str()) == 0);
+
+    BlockManager manager("", 1ul << 32);
+    CHECK(!manager.is_cold(manager.alloc(6)));
+    CHECK_THROWS_AS(manager.alloc_cold(6), std::invalid_argument);
+}
+
+TEST_CASE("testing the BlockManager: reopen")
+{
+    const std::string path = "./blocks";
+    uintptr_t pointer, freed_pointer;
+    BlockStats stats;
+
+    {
+        BlockManager manager(path, 1ul << 32);
+        CHECK(manager.get_metadata().empty());
+        pointer = manager.alloc(6);
+        strcpy(manager.convert<char>(pointer), "block");
+        freed_pointer = manager.alloc(18);
+        manager.free(freed_pointer, 18);
+        manager.set_metadata("metadata");
+        stats = manager.stats();
+    }
+
+    {
+        // blocks and free lists survive a clean close
+        BlockManager manager(path, 1ul << 32);
+        CHECK(manager.get_metadata() == "metadata");
+        CHECK(std::string(manager.convert<char>(pointer)) == "block");
+        CHECK(manager.stats().used_size == stats.used_size);
+        CHECK(manager.stats().free_size == stats.free_size);
+        CHECK(manager.alloc(18) == freed_pointer);
+        auto new_pointer = manager.alloc(6);
+        CHECK(new_pointer != pointer);
+        CHECK(new_pointer != manager.NULLPOINTER);
+    }
+
+    {
+        // a file that is not closed cleanly starts over
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(0);
+        file.write("\0", 1);
+    }
+    {
+        BlockManager manager(path, 1ul << 32);
+        CHECK(manager.get_metadata().empty());
+        CHECK(manager.alloc(6) != manager.NULLPOINTER);
+    }
+
+    CHECK(std::remove(path.c_str()) == 0);
+}
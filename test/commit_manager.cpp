@@ -0,0 +1,337 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/commit_manager.hpp"
+#include "core/wal_tail.hpp"
+
+using namespace livegraph;
+
+static size_t count_segments(const std::string &path)
+{
+    size_t num_segments = 0;
+    for (auto &entry : std::filesystem::directory_iterator(path))
+        num_segments += entry.path().extension() == ".wal";
+    return num_segments;
+}
+
+static void test_commit_manager(bool use_io_uring)
+{
+    const std::string path = "./wal_segments";
+    const size_t segment_size = 4096;
+    const size_t num_commits = 256;
+    const std::string wal(200, 'x');
+    std::atomic<timestamp_t> epoch_id(0);
+    size_t logged_txns = 0;
+
+    {
+        CommitManager commit_manager(path, epoch_id, 1, segment_size, use_io_uring);
+        CHECK(commit_manager.recover(0, [](const WALGroupHeader &, std::string_view) {}, [] {}) == 0);
+        for (size_t i = 0; i < num_commits; i++)
+        {
+            auto [commit_epoch_id, num_unfinished] = commit_manager.register_commit(wal, Durability::Sync);
+            CHECK(commit_epoch_id == (timestamp_t)i + 1);
+            commit_manager.finish_commit(commit_epoch_id, num_unfinished, true);
+        }
+    }
+    CHECK(count_segments(path) > num_commits * wal.size() / segment_size);
+
+    {
+        // groups are replayed in order across segments
+        std::vector<timestamp_t> epochs;
+        CommitManager commit_manager(path, epoch_id, 1, segment_size, use_io_uring);
+        auto recovered_epoch_id = commit_manager.recover(
+            0,
+            [&](const WALGroupHeader &header, std::string_view txns) {
+                CHECK(txns == wal);
+                epochs.emplace_back(header.epoch_id);
+            },
+            [] {});
+        CHECK(recovered_epoch_id == num_commits);
+        CHECK(epochs.size() == num_commits);
+        for (size_t i = 0; i < epochs.size(); i++)
+            CHECK(epochs[i] == (timestamp_t)i + 1);
+
+        // released segments are reused or deleted
+        commit_manager.truncate(recovered_epoch_id);
+        auto [commit_epoch_id, num_unfinished] = commit_manager.register_commit(wal, Durability::Sync);
+        CHECK(commit_epoch_id == num_commits + 1);
+        commit_manager.finish_commit(commit_epoch_id, num_unfinished, true);
+    }
+    CHECK(count_segments(path) < num_commits * wal.size() / segment_size);
+
+    {
+        // only the groups after a checkpoint are replayed
+        size_t num_groups = 0;
+        CommitManager commit_manager(path, epoch_id, 1, segment_size, use_io_uring);
+        auto recovered_epoch_id = commit_manager.recover(
+            num_commits, [&](const WALGroupHeader &, std::string_view) { ++num_groups; }, [] {});
+        CHECK(recovered_epoch_id == num_commits + 1);
+        CHECK(num_groups == 1);
+
+        // unlogged commits take an epoch without a group
+        {
+            auto [commit_epoch_id, num_unfinished] = commit_manager.register_commit({}, Durability::None);
+            CHECK(commit_epoch_id == num_commits + 2);
+            commit_manager.finish_commit(commit_epoch_id, num_unfinished, true);
+            CHECK(epoch_id.load() == commit_epoch_id);
+        }
+
+        // concurrent commits of all durability levels
+        const size_t num_threads = 8;
+        std::atomic<size_t> num_logged(0);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < num_threads; i++)
+        {
+            threads.emplace_back([&, i]() {
+                for (size_t j = 0; j < num_commits; j++)
+                {
+                    auto durability = static_cast<Durability>((i + j) % 3);
+                    num_logged += durability != Durability::None;
+                    auto [commit_epoch_id, num_unfinished] = commit_manager.register_commit(
+                        durability == Durability::None ? std::string_view() : std::string_view(wal), durability);
+                    commit_manager.finish_commit(commit_epoch_id, num_unfinished, j % 2);
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        logged_txns = num_logged;
+    }
+
+    {
+        size_t num_txns = 0;
+        timestamp_t prev_epoch_id = num_commits + 1;
+        CommitManager commit_manager(path, epoch_id, 1, segment_size, use_io_uring);
+        commit_manager.recover(
+            num_commits + 1,
+            [&](const WALGroupHeader &header, std::string_view txns) {
+                CHECK(header.epoch_id > prev_epoch_id);
+                CHECK(txns.size() == header.num_txns * wal.size());
+                prev_epoch_id = header.epoch_id;
+                num_txns += header.num_txns;
+            },
+            [] {});
+        CHECK(num_txns == logged_txns);
+    }
+
+    CHECK(std::filesystem::remove_all(path) > 0);
+}
+
+TEST_CASE("testing the CommitManager")
+{
+    test_commit_manager(true);
+    test_commit_manager(false);
+}
+
+TEST_CASE("testing the CommitManager: streams")
+{
+    const std::string path = "./wal_streams";
+    const size_t num_threads = 8;
+    const size_t num_commits = 256;
+    std::atomic<timestamp_t> epoch_id(0);
+
+    {
+        CommitManager commit_manager(path, epoch_id, 4, 4096);
+        CHECK(commit_manager.recover(0, [](const WALGroupHeader &, std::string_view) {}, [] {}) == 0);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < num_threads; i++)
+        {
+            threads.emplace_back([&, i]() {
+                // Sync commits also wait for the Async groups of other streams
+                std::string wal(8 + i, 'x');
+                auto durability = i % 2 ? Durability::Async : Durability::Sync;
+                for (size_t j = 0; j < num_commits; j++)
+                {
+                    auto [commit_epoch_id, num_unfinished] = commit_manager.register_commit(wal, durability);
+                    commit_manager.finish_commit(commit_epoch_id, num_unfinished, true);
+                    CHECK(epoch_id.load() >= commit_epoch_id);
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    // fewer streams still recover the groups of all of them in order
+    for (size_t num_streams : {1, 4})
+    {
+        size_t num_txns = 0;
+        timestamp_t prev_epoch_id = 0;
+        CommitManager commit_manager(path, epoch_id, num_streams, 4096);
+        auto recovered_epoch_id = commit_manager.recover(
+            0,
+            [&](const WALGroupHeader &header, std::string_view) {
+                CHECK(header.epoch_id > prev_epoch_id);
+                prev_epoch_id = header.epoch_id;
+                num_txns += header.num_txns;
+            },
+            [] {});
+        CHECK(recovered_epoch_id == prev_epoch_id);
+        CHECK(num_txns == num_threads * num_commits);
+    }
+
+    CHECK(std::filesystem::remove_all(path) > 0);
+}
+
+TEST_CASE("testing the CommitManager: lost epochs")
+{
+    const std::string path = "./wal_lost";
+    std::atomic<timestamp_t> epoch_id(0);
+    // a group per segment
+    std::vector<std::string> wals;
+    for (char c : std::string("abcdef"))
+        wals.emplace_back(3000, c);
+    // a thread per commit, so that they alternate between the streams
+    auto commit = [](CommitManager &commit_manager, const std::string &wal) {
+        std::thread([&]() {
+            auto [commit_epoch_id, num_unfinished] = commit_manager.register_commit(wal, Durability::Async);
+            commit_manager.finish_commit(commit_epoch_id, num_unfinished, true);
+        }).join();
+    };
+    auto recover = [&](std::vector<std::string> &txns) {
+        CommitManager commit_manager(path, epoch_id, 2, 4096);
+        return commit_manager.recover(
+            0, [&](const WALGroupHeader &, std::string_view group) { txns.emplace_back(group); }, [] {});
+    };
+
+    {
+        CommitManager commit_manager(path, epoch_id, 2, 4096);
+        CHECK(commit_manager.recover(0, [](const WALGroupHeader &, std::string_view) {}, [] {}) == 0);
+        for (size_t i = 0; i < 4; i++)
+            commit(commit_manager, wals[i]);
+    }
+
+    // epoch 2 is lost in its stream, then epochs 3 and 4 are not recovered
+    for (auto &entry : std::filesystem::recursive_directory_iterator(path))
+    {
+        if (!entry.is_regular_file())
+            continue;
+        std::fstream file(entry.path(), std::ios::binary | std::ios::in | std::ios::out);
+        std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        auto offset = data.find(wals[1]);
+        if (offset == std::string::npos)
+            continue;
+        file.seekp(offset);
+        file.put('x');
+    }
+    std::vector<std::string> txns;
+    CHECK(recover(txns) == 1);
+    CHECK(txns == std::vector<std::string>{wals[0]});
+
+    // and their groups are dropped, before new ones in both streams
+    {
+        CommitManager commit_manager(path, epoch_id, 2, 4096);
+        CHECK(commit_manager.recover(0, [](const WALGroupHeader &, std::string_view) {}, [] {}) == 1);
+        for (size_t i = 4; i < 6; i++)
+            commit(commit_manager, wals[i]);
+    }
+    txns.clear();
+    CHECK(recover(txns) == 3);
+    CHECK(txns == std::vector<std::string>{wals[0], wals[4], wals[5]});
+
+    CHECK(std::filesystem::remove_all(path) > 0);
+}
+
+TEST_CASE("testing the EpochSequencer")
+{
+    std::atomic<timestamp_t> epoch_id(0);
+    EpochSequencer sequencer(epoch_id);
+    auto first = sequencer.next_epoch(true);
+    auto second = sequencer.next_epoch(false);
+    auto third = sequencer.next_epoch(true);
+    CHECK(third.first == 3);
+
+    // epochs are durable in order, once the earlier groups are flushed
+    std::atomic<bool> durable(false);
+    std::thread waiter([&]() {
+        sequencer.wait_durable(third.first);
+        durable = true;
+    });
+    sequencer.flush({third.first});
+    while (!sequencer.sync_requested(third.first))
+        std::this_thread::yield();
+    CHECK(sequencer.sync_requested(first.first));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(!durable.load());
+    sequencer.flush({first.first});
+    waiter.join();
+    CHECK(durable.load());
+
+    // visibility is separate from durability
+    CHECK(epoch_id.load() == 0);
+    for (auto epoch : {first, second, third})
+        --*epoch.second;
+    sequencer.advance();
+    CHECK(epoch_id.load() == 3);
+}
+
+TEST_CASE("testing the WALTail")
+{
+    const std::string path = "./wal_tail";
+    const size_t segment_size = 4096;
+    const size_t num_commits = 256;
+    const std::string wal(200, 'x');
+    std::atomic<timestamp_t> epoch_id(0);
+
+    {
+        CommitManager commit_manager(path, epoch_id, 1, segment_size);
+        CHECK(commit_manager.recover(0, [](const WALGroupHeader &, std::string_view) {}, [] {}) == 0);
+
+        // groups after the begin epoch are read across segments as they are written
+        WALTail tail(path, 16);
+        timestamp_t prev_epoch_id = 16;
+        size_t num_flushes = 0;
+        auto poll = [&]() {
+            return tail.poll(
+                [&](const WALGroupHeader &header, std::string_view txns) {
+                    CHECK(header.epoch_id == prev_epoch_id + 1);
+                    CHECK(txns == wal);
+                    prev_epoch_id = header.epoch_id;
+                },
+                [&]() { num_flushes++; });
+        };
+        CHECK(poll() == 0);
+        for (size_t i = 0; i < num_commits; i++)
+        {
+            auto [commit_epoch_id, num_unfinished] = commit_manager.register_commit(wal, Durability::Sync);
+            commit_manager.finish_commit(commit_epoch_id, num_unfinished, true);
+            if (i % 32 == 0)
+                poll();
+        }
+        poll();
+        CHECK(prev_epoch_id == num_commits);
+        CHECK(num_flushes > 0);
+        CHECK(!tail.is_lost());
+
+        // a tail behind released segments is lost
+        WALTail lagging_tail(path, 0);
+        commit_manager.truncate(num_commits);
+        lagging_tail.poll([](const WALGroupHeader &, std::string_view) {}, [] {});
+        CHECK(lagging_tail.is_lost());
+    }
+
+    CHECK(std::filesystem::remove_all(path) > 0);
+}
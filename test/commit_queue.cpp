@@ -0,0 +1,87 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/commit_queue.hpp"
+
+using namespace livegraph;
+
+TEST_CASE("testing the CommitQueue")
+{
+    CHECK_THROWS_AS(CommitQueue(3), std::invalid_argument);
+
+    const size_t num_clients = 8;
+    const size_t num_commits = 1ul << 12;
+    // smaller than the number of clients, so the ring gets full
+    CommitQueue commits(4);
+    std::atomic<bool> closed(false);
+    std::atomic<int> num_unfinished(0);
+    size_t num_served = 0;
+
+    std::thread server([&]() {
+        timestamp_t epoch_id = 0;
+        while (!closed.load() || commits.ready(1))
+        {
+            size_t num = commits.ready(2);
+            if (!num)
+            {
+                commits.wait_push(std::chrono::microseconds(100));
+                continue;
+            }
+            auto first_ticket = commits.front();
+            ++epoch_id;
+            for (size_t i = 0; i < num; i++)
+            {
+                auto &slot = commits.at(first_ticket + i);
+                CHECK(slot.wal.size() == sizeof(size_t));
+                slot.epoch_id = epoch_id;
+                slot.num_unfinished = &num_unfinished;
+            }
+            commits.pop(num);
+            for (size_t i = 0; i < num; i++)
+                commits.release(first_ticket + i);
+            num_served += num;
+        }
+    });
+
+    std::vector<std::thread> clients;
+    for (size_t i = 0; i < num_clients; i++)
+    {
+        clients.emplace_back([&, i]() {
+            std::string wal(reinterpret_cast<const char *>(&i), sizeof(i));
+            timestamp_t prev_epoch_id = 0;
+            for (size_t j = 0; j < num_commits; j++)
+            {
+                auto [epoch_id, unfinished] = commits.wait(commits.push(wal, Durability::Sync));
+                CHECK(epoch_id > prev_epoch_id);
+                CHECK(unfinished == &num_unfinished);
+                prev_epoch_id = epoch_id;
+            }
+        });
+    }
+    for (auto &client : clients)
+        client.join();
+    closed.store(true);
+    commits.notify();
+    server.join();
+
+    CHECK(num_served == num_clients * num_commits);
+}
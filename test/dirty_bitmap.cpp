@@ -0,0 +1,56 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <doctest/doctest.h>
+
+#include <thread>
+#include <vector>
+
+#include "core/dirty_bitmap.hpp"
+
+using namespace livegraph;
+
+TEST_CASE("testing the DirtyBitmap")
+{
+    DirtyBitmap bitmap;
+    CHECK(bitmap.drain().empty());
+
+    const vertex_t size = 1ul << 20;
+    bitmap.grow(size);
+    bitmap.mark(size - 1);
+    bitmap.mark(64);
+    bitmap.mark(3);
+    bitmap.mark(64);
+    CHECK(bitmap.drain() == std::vector<vertex_t>{3, 64, size - 1});
+    CHECK(bitmap.drain().empty());
+
+    // no mark is lost while draining
+    std::thread marker([&]() {
+        for (vertex_t i = 0; i < size; i += 7)
+            bitmap.mark(i);
+    });
+    std::vector<vertex_t> vertices;
+    for (size_t round = 0; round < 100; round++)
+    {
+        auto drained = bitmap.drain();
+        vertices.insert(vertices.end(), drained.begin(), drained.end());
+    }
+    marker.join();
+    auto drained = bitmap.drain();
+    vertices.insert(vertices.end(), drained.begin(), drained.end());
+    CHECK(vertices.size() == (size + 6) / 7);
+    for (auto vertex : vertices)
+        CHECK(vertex % 7 == 0);
+}
@@ -0,0 +1,72 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <doctest/doctest.h>
+
+#include <thread>
+#include <vector>
+
+#include "core/epoch_manager.hpp"
+
+using namespace livegraph;
+
+TEST_CASE("testing the EpochManager")
+{
+    std::atomic<timestamp_t> epoch_id(5);
+    EpochManager epochs(epoch_id);
+    CHECK(epochs.low_watermark() == 5);
+
+    auto [first_epoch_id, first] = epochs.enter();
+    CHECK(first_epoch_id == 5);
+    epoch_id = 7;
+    CHECK(epochs.low_watermark() == 5);
+    // a later transaction of the thread ends first
+    auto [second_epoch_id, second] = epochs.enter();
+    CHECK(second_epoch_id == 7);
+    auto third = epochs.enter().second;
+    epochs.exit(second);
+    // transactions which did not enter are ignored
+    epochs.exit(EpochManager::NO_HANDLE);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    CHECK(epochs.low_watermark() == 5);
+    epochs.exit(first);
+    // the slots are scanned again after a while
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    CHECK(epochs.low_watermark() == 7);
+    epochs.exit(third);
+
+    // of other threads
+    std::thread reader([&]() { CHECK(epochs.enter().first == 7); });
+    reader.join();
+    epoch_id = 8;
+    CHECK(epochs.low_watermark() == 7);
+
+    std::vector<uintptr_t> freed;
+    auto free = [&](uintptr_t pointer, order_t) { freed.push_back(pointer); };
+    epochs.retire(64, 6);
+    epochs.retire(128, 6);
+    CHECK(epochs.get_retired_size() == 128);
+    CHECK(epochs.reclaim(8, free) == 0);
+    CHECK(epochs.reclaim(9, free) == 128);
+    CHECK(freed == std::vector<uintptr_t>{64, 128});
+    CHECK(epochs.get_retired_size() == 0);
+
+    // retired by other threads
+    std::thread compactor([&]() { epochs.retire(256, 7); });
+    compactor.join();
+    CHECK(epochs.get_retired_size() == 128);
+    CHECK(epochs.reclaim(9, free) == 128);
+    CHECK(freed.back() == 256);
+}
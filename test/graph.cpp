@@ -15,13 +15,23 @@
 
 #include <doctest/doctest.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <map>
 #include <mutex>
 #include <random>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include <fcntl.h>
 #include <omp.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "bind/livegraph.hpp"
 #include "core/livegraph.hpp"
@@ -256,3 +266,868 @@ TEST_CASE_TEMPLATE("testing the Graph", GraphType, livegraph::Graph, lg::Graph)
 
     CHECK(std::remove("./block.mmap") == 0);
 }
+
+TEST_CASE("testing the Graph: recover")
+{
+    using namespace livegraph;
+    const vertex_t max_vertices = 64;
+    const label_t max_label = 4;
+    const size_t num_transactions = 1024;
+    std::vector<std::string> vertices(max_vertices);
+    std::map<std::tuple<vertex_t, label_t, vertex_t>, std::string> edges;
+    timestamp_t last_epoch_id;
+
+    {
+        Graph graph("", "./wal");
+        {
+            auto txn = graph.begin_transaction();
+            for (vertex_t i = 0; i < max_vertices; i++)
+                CHECK(txn.new_vertex() == i);
+            txn.commit();
+        }
+
+        std::mt19937 rand(0);
+        for (size_t i = 0; i < num_transactions; i++)
+        {
+            auto txn = graph.begin_transaction();
+            auto src = rand() % max_vertices;
+            auto dst = rand() % max_vertices;
+            label_t label = rand() % max_label;
+            auto data = std::to_string(rand());
+            switch (rand() % 4)
+            {
+            case 0:
+                txn.put_vertex(src, data);
+                vertices[src] = data;
+                break;
+            case 1:
+                txn.del_vertex(src);
+                vertices[src] = "";
+                break;
+            case 2:
+                txn.del_edge(src, label, dst);
+                edges.erase(std::make_tuple(src, label, dst));
+                break;
+            default:
+                txn.put_edge(src, label, dst, data);
+                edges[std::make_tuple(src, label, dst)] = data;
+                break;
+            }
+            last_epoch_id = txn.commit();
+        }
+    }
+
+    auto check_graph = [&](Graph &graph) {
+        auto txn = graph.begin_read_only_transaction();
+        CHECK(txn.get_read_epoch_id() == last_epoch_id);
+        CHECK(graph.get_max_vertex_id() == max_vertices);
+        for (vertex_t src = 0; src < max_vertices; src++)
+        {
+            CHECK(txn.get_vertex(src) == vertices[src]);
+            for (label_t label = 0; label < max_label; label++)
+            {
+                size_t num_edges = 0;
+                for (auto iter = txn.get_edges(src, label); iter.valid(); iter.next())
+                {
+                    auto edge = edges.find(std::make_tuple(src, label, iter.dst_id()));
+                    CHECK(edge != edges.end());
+                    if (edge != edges.end())
+                        CHECK(edge->second == iter.edge_data());
+                    ++num_edges;
+                }
+                CHECK(num_edges == (size_t)std::distance(edges.lower_bound(std::make_tuple(src, label, 0)),
+                                                         edges.lower_bound(std::make_tuple(src, label + 1, 0))));
+            }
+        }
+    };
+
+    {
+        Graph graph("", "./wal");
+        check_graph(graph);
+    }
+
+    {
+        // a torn group at the tail is dropped
+        std::string segment_path, segment;
+        WALSegmentHeader segment_header;
+        std::set<std::string> paths;
+        for (auto &entry : std::filesystem::directory_iterator("./wal"))
+            paths.emplace(entry.path().string());
+        for (auto &path : paths)
+        {
+            // the active segment is followed by preallocated ones without a header
+            std::ifstream file(path, std::ios::binary);
+            std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            memcpy(&segment_header, data.data(), sizeof(segment_header));
+            if (segment_header.magic != WAL_SEGMENT_MAGIC)
+                break;
+            segment_path = path;
+            segment = data;
+        }
+        memcpy(&segment_header, segment.data(), sizeof(segment_header));
+        size_t offset = sizeof(segment_header);
+        WALGroupHeader header;
+        for (auto prev_epoch_id = segment_header.prev_epoch_id;; prev_epoch_id = header.epoch_id)
+        {
+            auto length = check_wal_group(std::string_view(segment).substr(offset), prev_epoch_id, header);
+            if (!length)
+                break;
+            offset += length;
+        }
+        header = {last_epoch_id + 1, 1, 1024, 0, last_epoch_id};
+        std::fstream torn_file(segment_path, std::ios::binary | std::ios::in | std::ios::out);
+        torn_file.seekp(offset);
+        torn_file.write(reinterpret_cast<char *>(&header), sizeof(header));
+        torn_file.close();
+
+        Graph graph("", "./wal");
+        check_graph(graph);
+
+        auto txn = graph.begin_transaction();
+        txn.put_vertex(0, "recovered");
+        vertices[0] = "recovered";
+        last_epoch_id = txn.commit();
+        CHECK(last_epoch_id == header.epoch_id);
+    }
+
+    {
+        Graph graph("", "./wal");
+        check_graph(graph);
+    }
+
+    {
+        // a checkpoint also covers batch loaded data
+        Graph graph("", "./wal");
+        {
+            auto txn = graph.begin_batch_loader();
+            txn.put_edge(1, 0, 2, "batch");
+            edges[std::make_tuple(1, 0, 2)] = "batch";
+            txn.commit();
+        }
+        CHECK(graph.checkpoint() == last_epoch_id);
+
+        auto txn = graph.begin_transaction();
+        txn.put_vertex(1, "checkpoint");
+        vertices[1] = "checkpoint";
+        last_epoch_id = txn.commit();
+    }
+
+    {
+        Graph graph("", "./wal");
+        check_graph(graph);
+        CHECK(graph.checkpoint() == last_epoch_id);
+    }
+
+    vertex_t recycled_vid;
+    {
+        // recycled ids are kept by the checkpoint
+        Graph graph("", "./wal");
+        check_graph(graph);
+        auto txn = graph.begin_transaction();
+        recycled_vid = txn.new_vertex();
+        txn.del_vertex(recycled_vid, true);
+        txn.commit();
+        graph.checkpoint();
+    }
+
+    {
+        Graph graph("", "./wal");
+        auto txn = graph.begin_transaction();
+        CHECK(txn.new_vertex(true) == recycled_vid);
+        txn.abort();
+    }
+
+    CHECK(std::filesystem::remove_all("./wal") > 0);
+}
+
+TEST_CASE("testing the Graph: durability")
+{
+    using namespace livegraph;
+    timestamp_t last_epoch_id;
+
+    {
+        Graph graph("", "./wal", 1ul << 30, 1ul << 20, Durability::Async);
+        {
+            auto txn = graph.begin_transaction(Durability::Sync);
+            CHECK(txn.new_vertex() == 0);
+            CHECK(txn.new_vertex() == 1);
+            CHECK(txn.new_vertex() == 2);
+            txn.put_vertex(0, "sync");
+            CHECK(txn.commit() == 1);
+        }
+        {
+            auto txn = graph.begin_transaction(Durability::None);
+            txn.put_vertex(1, "none");
+            CHECK(txn.commit() == 2);
+        }
+        {
+            auto txn = graph.begin_transaction();
+            txn.put_vertex(2, "async");
+            last_epoch_id = txn.commit();
+            CHECK(last_epoch_id == 3);
+        }
+    }
+
+    {
+        // groups after an epoch without logged transactions are recovered
+        Graph graph("", "./wal");
+        auto txn = graph.begin_read_only_transaction();
+        CHECK(txn.get_read_epoch_id() == last_epoch_id);
+        CHECK(graph.get_max_vertex_id() == 3);
+        CHECK(txn.get_vertex(0) == "sync");
+        CHECK(txn.get_vertex(1) == "");
+        CHECK(txn.get_vertex(2) == "async");
+    }
+
+    CHECK(std::filesystem::remove_all("./wal") > 0);
+}
+
+TEST_CASE("testing the Graph: change stream")
+{
+    using namespace livegraph;
+    {
+        Graph graph("", "./wal", 1ul << 30, 1ul << 20);
+        {
+            auto txn = graph.begin_transaction();
+            txn.new_vertex();
+            txn.commit();
+        }
+
+        auto stream = graph.subscribe(2);
+        CHECK(stream->get_start_epoch_id() == 1);
+        ChangeRecord record;
+        CHECK(!stream->next(record, std::chrono::milliseconds(1)));
+
+        {
+            auto txn = graph.begin_transaction();
+            CHECK(txn.new_vertex() == 1);
+            txn.put_vertex(1, "vertex");
+            txn.put_edge(0, 2, 1, "edge");
+            CHECK(txn.commit() == 2);
+        }
+        {
+            auto txn = graph.begin_transaction(Durability::None);
+            txn.put_vertex(0, "none");
+            txn.commit();
+        }
+        {
+            auto txn = graph.begin_transaction();
+            CHECK(txn.del_edge(0, 2, 1));
+            CHECK(txn.del_vertex(1));
+            CHECK(txn.commit() == 4);
+        }
+
+        CHECK(stream->next(record, std::chrono::seconds(1)));
+        CHECK(record.epoch_id == 2);
+        REQUIRE(record.operations.size() == 3);
+        CHECK(record.operations[0].type == OPType::NewVertex);
+        CHECK(record.operations[0].src == 1);
+        CHECK(record.operations[1].type == OPType::PutVertex);
+        CHECK(record.operations[1].data == "vertex");
+        CHECK(record.operations[2].type == OPType::PutEdge);
+        CHECK(record.operations[2].src == 0);
+        CHECK(record.operations[2].label == 2);
+        CHECK(record.operations[2].dst == 1);
+        CHECK(record.operations[2].data == "edge");
+
+        CHECK(stream->next(record, std::chrono::seconds(1)));
+        CHECK(record.epoch_id == 4);
+        REQUIRE(record.operations.size() == 2);
+        CHECK(record.operations[0].type == OPType::DelEdge);
+        CHECK(record.operations[1].type == OPType::DelVertex);
+        CHECK(!stream->next(record, std::chrono::milliseconds(1)));
+        CHECK(!stream->is_overflowed());
+
+        // a consumer falling behind loses the stream
+        for (size_t i = 0; i < 3; i++)
+        {
+            auto txn = graph.begin_transaction();
+            txn.put_vertex(0, "overflow");
+            txn.commit();
+        }
+        // the changes are delivered right after the epoch becomes visible
+        for (size_t i = 0; i < 1000 && !stream->is_overflowed(); i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        CHECK(stream->is_overflowed());
+        CHECK(!stream->next(record, std::chrono::milliseconds(1)));
+    }
+
+    CHECK(std::filesystem::remove_all("./wal") > 0);
+}
+
+TEST_CASE("testing the Graph: follower")
+{
+    using namespace livegraph;
+    {
+        Graph primary("", "./wal", 1ul << 30, 1ul << 20);
+        {
+            auto txn = primary.begin_transaction();
+            for (vertex_t i = 0; i < 16; i++)
+                txn.put_vertex(txn.new_vertex(), "checkpoint");
+            txn.commit();
+        }
+        primary.checkpoint();
+        {
+            auto txn = primary.begin_transaction();
+            txn.put_edge(0, 1, 2, "wal");
+            txn.commit();
+        }
+
+        Graph follower("", "", 1ul << 30, 1ul << 20);
+        follower.follow("./wal");
+        CHECK(follower.is_following());
+        CHECK_THROWS_AS(follower.begin_transaction(), std::invalid_argument);
+        CHECK_THROWS_AS(follower.follow("./wal"), std::invalid_argument);
+        {
+            auto txn = follower.begin_read_only_transaction();
+            CHECK(txn.get_read_epoch_id() == 2);
+            CHECK(follower.get_max_vertex_id() == 16);
+            CHECK(txn.get_vertex(15) == "checkpoint");
+            CHECK(txn.get_edge(0, 1, 2) == "wal");
+        }
+
+        // later updates of a vertex are replayed in order
+        auto reader = follower.begin_read_only_transaction();
+        auto prev_epoch_id = reader.get_read_epoch_id();
+        timestamp_t last_epoch_id = 0;
+        for (size_t i = 0; i < 64; i++)
+        {
+            auto txn = primary.begin_transaction();
+            txn.put_vertex(i % 16, std::to_string(i));
+            txn.put_edge(i % 16, 0, 0, std::to_string(i));
+            last_epoch_id = txn.commit();
+        }
+
+        for (size_t i = 0; i < 1000 && follower.begin_read_only_transaction().get_read_epoch_id() < last_epoch_id; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        {
+            auto txn = follower.begin_read_only_transaction();
+            CHECK(txn.get_read_epoch_id() == last_epoch_id);
+            for (vertex_t i = 0; i < 16; i++)
+            {
+                CHECK(txn.get_vertex(i) == std::to_string(48 + i));
+                CHECK(txn.get_edge(i, 0, 0) == std::to_string(48 + i));
+            }
+        }
+        // readers keep their snapshot during replay
+        CHECK(reader.get_vertex(15) == "checkpoint");
+        CHECK(reader.get_read_epoch_id() == prev_epoch_id);
+        reader.abort();
+        CHECK(follower.is_following());
+
+        // replayed versions are compacted once no reader needs them, and a
+        // reused id drops the old vertex
+        {
+            auto txn = primary.begin_transaction();
+            txn.del_vertex(15, true);
+            txn.commit();
+        }
+        {
+            auto txn = primary.begin_transaction();
+            CHECK(txn.new_vertex(true) == 15);
+            txn.put_vertex(15, "reused");
+            last_epoch_id = txn.commit();
+        }
+        // blocks are freed once later epochs are replayed
+        for (size_t i = 0; i < 100 && (follower.stats().num_garbage_blocks || follower.stats().retired_size); i++)
+        {
+            {
+                auto txn = primary.begin_transaction();
+                txn.put_vertex(txn.new_vertex(), "last");
+                last_epoch_id = txn.commit();
+            }
+            for (size_t j = 0;
+                 j < 1000 && follower.begin_read_only_transaction().get_read_epoch_id() < last_epoch_id; j++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto stats = follower.stats();
+        CHECK(stats.num_garbage_blocks == 0);
+        CHECK(stats.retired_size == 0);
+        CHECK(stats.num_deleted_edges == 0);
+        {
+            auto txn = follower.begin_read_only_transaction();
+            CHECK(txn.get_vertex(15) == "reused");
+            CHECK(txn.get_edge(15, 0, 0) == "");
+            CHECK(txn.get_vertex(16) == "last");
+        }
+    }
+
+    CHECK(std::filesystem::remove_all("./wal") > 0);
+}
+
+TEST_CASE("testing the Graph: reopen")
+{
+    using namespace livegraph;
+    timestamp_t last_epoch_id;
+    GraphStats stats;
+
+    {
+        Graph graph("./blocks", "./wal", 1ul << 32, 1ul << 20);
+        {
+            auto txn = graph.begin_transaction();
+            for (vertex_t i = 0; i < 4; i++)
+                txn.put_vertex(txn.new_vertex(), "vertex" + std::to_string(i));
+            txn.put_edge(0, 1, 2, "edge");
+            txn.put_edge(0, 1, 3, "edge");
+            txn.del_vertex(3, true);
+            txn.commit();
+        }
+        // an old version and a deleted edge are left
+        auto txn = graph.begin_transaction();
+        txn.put_vertex(1, "vertex1");
+        txn.del_edge(0, 1, 3);
+        last_epoch_id = txn.commit();
+        stats = graph.stats();
+        CHECK(stats.num_garbage_blocks > 0);
+        CHECK(stats.num_deleted_edges == 1);
+    }
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        // nothing is replayed from the WAL of a graph closed cleanly
+        Graph graph("./blocks", i ? "" : "./wal", 1ul << 32, 1ul << 20);
+        auto txn = graph.begin_read_only_transaction();
+        CHECK(txn.get_read_epoch_id() == last_epoch_id);
+        CHECK(graph.get_max_vertex_id() == 4);
+        CHECK(txn.get_vertex(2) == "vertex2");
+        CHECK(txn.get_vertex(3) == "");
+        CHECK(txn.get_edge(0, 1, 2) == "edge");
+        size_t num_edges = 0;
+        for (auto iter = txn.get_edges(0, 1); iter.valid(); iter.next())
+            num_edges++;
+        CHECK(num_edges == 1);
+        txn.abort();
+
+        // the stats are rebuilt, and the garbage is compacted later
+        auto reopened_stats = graph.stats();
+        CHECK(reopened_stats.vertex_block_size == stats.vertex_block_size);
+        CHECK(reopened_stats.edge_block_size == stats.edge_block_size);
+        CHECK(reopened_stats.edge_label_block_size == stats.edge_label_block_size);
+        CHECK(reopened_stats.num_garbage_blocks == stats.num_garbage_blocks);
+        CHECK(reopened_stats.garbage_size == stats.garbage_size);
+        CHECK(reopened_stats.num_deleted_edges == stats.num_deleted_edges);
+        if (i == 1)
+        {
+            // the copies of edge blocks are freed one epoch later
+            for (size_t j = 0; j < 2; j++)
+            {
+                graph.begin_transaction().commit();
+                graph.compact();
+            }
+            CHECK(graph.stats().num_garbage_blocks == 0);
+            CHECK(graph.stats().num_deleted_edges == 0);
+        }
+    }
+
+    {
+        Graph graph("./blocks", "", 1ul << 32, 1ul << 20);
+        auto txn = graph.begin_transaction();
+        CHECK(txn.new_vertex(true) == 3);
+        txn.put_vertex(3, "vertex3");
+        txn.commit();
+    }
+
+    {
+        Graph graph("./blocks", "", 1ul << 32, 1ul << 20);
+        auto txn = graph.begin_read_only_transaction();
+        CHECK(txn.get_vertex(3) == "vertex3");
+    }
+
+    CHECK(std::remove("./blocks") == 0);
+    CHECK(std::filesystem::remove_all("./wal") > 0);
+}
+
+TEST_CASE("testing the Graph: partitioned scan")
+{
+    using namespace livegraph;
+    const vertex_t num_vertices = 10000;
+    Graph graph("", "", 1ul << 32, 1ul << 20, Durability::None, 1, HugePages::None, NumaPlacement::Vertex);
+    {
+        auto txn = graph.begin_transaction();
+        for (vertex_t i = 0; i < num_vertices; i++)
+            txn.new_vertex();
+        for (vertex_t i = 0; i + 1 < num_vertices; i++)
+            txn.put_edge(i, 0, i + 1, "edge");
+        txn.commit();
+    }
+    {
+        // a second edge of vertex 0
+        auto txn = graph.begin_transaction();
+        txn.put_edge(0, 0, 2, "edge");
+        txn.commit();
+    }
+
+    std::vector<std::atomic<size_t>> visits(num_vertices);
+    for (auto &visit : visits)
+        visit = 0;
+    std::atomic<size_t> num_edges(0);
+    graph.partitioned_scan([&](Transaction &txn, vertex_t vertex) {
+        visits[vertex]++;
+        for (auto iter = txn.get_edges(vertex, 0); iter.valid(); iter.next())
+        {
+            CHECK(iter.dst_id() > vertex);
+            num_edges++;
+        }
+    });
+    for (auto &visit : visits)
+        CHECK(visit == 1);
+    CHECK(num_edges == num_vertices);
+
+    // the first error of the threads is rethrown
+    auto fail = [](Transaction &, vertex_t vertex) {
+        if (vertex == 42)
+            throw std::runtime_error("scan error.");
+    };
+    CHECK_THROWS_AS(graph.partitioned_scan(fail), std::runtime_error);
+}
+
+// of a file in the page cache
+static size_t count_resident_pages(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    REQUIRE(fd != -1);
+    auto size = lseek(fd, 0, SEEK_END);
+    auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    REQUIRE(data != MAP_FAILED);
+    auto page_size = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((size + page_size - 1) / page_size);
+    REQUIRE(mincore(data, size, pages.data()) == 0);
+    munmap(data, size);
+    close(fd);
+    return std::count_if(pages.begin(), pages.end(), [](unsigned char page) { return page & 1; });
+}
+
+TEST_CASE("testing the Graph: tiers")
+{
+    using namespace livegraph;
+    const vertex_t num_vertices = 100;
+    Graph graph("", "", 1ul << 32, 1ul << 20, Durability::None, 1, HugePages::None, NumaPlacement::None,
+                "./cold_blocks");
+    {
+        auto txn = graph.begin_transaction();
+        for (vertex_t i = 0; i < num_vertices; i++)
+            txn.new_vertex();
+        for (vertex_t i = 0; i + 1 < num_vertices; i++)
+            txn.put_edge(i, 0, i + 1, "edge");
+        txn.commit();
+    }
+
+    auto check_edges = [&]() {
+        auto txn = graph.begin_read_only_transaction();
+        for (vertex_t i = 0; i + 1 < num_vertices; i++)
+        {
+            auto iter = txn.get_edges(i, 0);
+            CHECK(iter.valid());
+            CHECK(iter.dst_id() == i + 1);
+            CHECK(iter.edge_data() == "edge");
+            iter.next();
+            CHECK(!iter.valid());
+        }
+    };
+
+    // the edges were just written
+    CHECK(graph.migrate_blocks() == 0);
+    // and are cold now, out of memory
+    CHECK(graph.migrate_blocks() > 0);
+    CHECK(count_resident_pages("./cold_blocks") == 0);
+    auto txn = graph.begin_read_only_transaction();
+    auto edges = txn.get_edges(5, 0);
+    CHECK(edges.dst_id() == 6);
+    txn.abort();
+    // only the edges of vertex 5 are hot again
+    auto promoted_size = graph.migrate_blocks();
+    CHECK(promoted_size > 0);
+    CHECK(graph.migrate_blocks() == promoted_size);
+    check_edges();
+
+    {
+        auto txn = graph.begin_transaction();
+        txn.put_edge(7, 0, 9, "edge");
+        txn.del_edge(7, 0, 9);
+        txn.commit();
+    }
+    graph.compact();
+    check_edges();
+    CHECK(std::remove("./cold_blocks") == 0);
+}
+
+TEST_CASE("testing the Graph: stats")
+{
+    using namespace livegraph;
+    Graph graph;
+    auto stats = graph.stats();
+    CHECK(stats.vertex_block_size == 0);
+    CHECK(stats.edge_block_size == 0);
+    CHECK(stats.blocks.used_size <= stats.blocks.file_size);
+
+    {
+        auto txn = graph.begin_transaction();
+        for (vertex_t i = 0; i < 100; i++)
+            txn.put_vertex(txn.new_vertex(), "vertex");
+        for (vertex_t i = 0; i < 100; i++)
+            txn.put_edge(0, 0, i, "edge");
+        txn.commit();
+    }
+    stats = graph.stats();
+    CHECK(stats.vertex_block_size >= 100 * sizeof(VertexBlockHeader));
+    CHECK(stats.edge_block_size >= 100 * sizeof(EdgeEntry));
+    CHECK(stats.edge_label_block_size > 0);
+    CHECK(stats.bloom_filter_size > 0);
+    CHECK(stats.num_deleted_edges == 0);
+    // the edge block of vertex 0 was grown several times
+    CHECK(stats.num_garbage_blocks > 0);
+
+    {
+        auto txn = graph.begin_transaction();
+        for (vertex_t i = 0; i < 10; i++)
+            txn.del_edge(0, 0, i);
+        txn.put_vertex(1, "new vertex");
+        txn.commit();
+    }
+    {
+        // aborted changes are not counted
+        auto txn = graph.begin_transaction();
+        txn.del_edge(0, 0, 50);
+        txn.put_vertex(2, "new vertex");
+        txn.abort();
+    }
+    auto garbage_stats = graph.stats();
+    CHECK(garbage_stats.num_deleted_edges == 10);
+    CHECK(garbage_stats.num_garbage_blocks == stats.num_garbage_blocks + 1);
+    CHECK(garbage_stats.vertex_block_size > stats.vertex_block_size);
+
+    // the first pass copies the edge block without the deleted edges, and
+    // the second frees the original
+    for (size_t pass = 0; pass < 2; pass++)
+    {
+        // moves the epoch past the garbage
+        auto txn = graph.begin_transaction();
+        txn.new_vertex();
+        txn.commit();
+        graph.compact();
+    }
+    stats = graph.stats();
+    CHECK(stats.num_deleted_edges == 0);
+    CHECK(stats.num_garbage_blocks == 0);
+    CHECK(stats.vertex_block_size < garbage_stats.vertex_block_size);
+    CHECK(stats.blocks.free_size > 0);
+
+    // the blocks unlinked by the last pass are freed after the epoch moves
+    CHECK(stats.retired_size > 0);
+    {
+        auto txn = graph.begin_transaction();
+        txn.new_vertex();
+        txn.commit();
+        graph.compact();
+    }
+    CHECK(graph.stats().retired_size == 0);
+}
+
+TEST_CASE("testing the Graph: background compaction")
+{
+    using namespace livegraph;
+    Graph graph;
+    CompactionOptions options;
+    options.num_threads = 2;
+    options.garbage_ratio = 0;
+    options.interval = std::chrono::milliseconds(1);
+    graph.start_compaction(options);
+    CHECK_THROWS_AS(graph.start_compaction(options), std::invalid_argument);
+
+    const vertex_t num_vertices = 64;
+    {
+        auto txn = graph.begin_transaction();
+        for (vertex_t i = 0; i < num_vertices; i++)
+            txn.new_vertex();
+        txn.commit();
+    }
+    // each thread rewrites its own vertices, and never compacts them itself
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < 2; t++)
+    {
+        writers.emplace_back([&, t]() {
+            for (size_t round = 0; round < 100; round++)
+            {
+                auto txn = graph.begin_transaction();
+                for (vertex_t i = t; i < num_vertices; i += 2)
+                {
+                    txn.put_vertex(i, std::to_string(round));
+                    txn.put_edge(i, 0, round % num_vertices, "edge");
+                    txn.del_edge(i, 0, (round + num_vertices - 1) % num_vertices);
+                }
+                txn.commit();
+            }
+        });
+    }
+    for (auto &writer : writers)
+        writer.join();
+
+    // the service catches up once writes stop
+    for (size_t i = 0; i < 1000 && graph.stats().num_garbage_blocks; i++)
+    {
+        auto txn = graph.begin_transaction();
+        txn.new_vertex();
+        txn.commit();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    graph.stop_compaction();
+    auto stats = graph.stats();
+    CHECK(stats.num_garbage_blocks == 0);
+    CHECK(stats.num_deleted_edges == 0);
+
+    auto txn = graph.begin_read_only_transaction();
+    for (vertex_t i = 0; i < num_vertices; i++)
+    {
+        CHECK(txn.get_vertex(i) == "99");
+        auto edges = txn.get_edges(i, 0);
+        CHECK(edges.valid());
+        CHECK(edges.dst_id() == 99 % num_vertices);
+        edges.next();
+        CHECK(!edges.valid());
+    }
+    txn.abort();
+
+    // stopped in the middle of rounds, which leave their vertices dirty
+    options.num_threads = 4;
+    options.interval = std::chrono::milliseconds(0);
+    for (size_t round = 0; round < 20; round++)
+    {
+        {
+            auto txn = graph.begin_transaction();
+            for (vertex_t i = 0; i < num_vertices; i++)
+                txn.put_vertex(i, "stopped");
+            txn.commit();
+        }
+        graph.start_compaction(options);
+        std::this_thread::sleep_for(std::chrono::microseconds(round * 50));
+        graph.stop_compaction();
+    }
+    for (size_t pass = 0; pass < 2; pass++)
+    {
+        auto txn = graph.begin_transaction();
+        txn.new_vertex();
+        txn.commit();
+        graph.compact();
+    }
+    CHECK(graph.stats().num_garbage_blocks == 0);
+}
+
+TEST_CASE("testing the Graph: parallel compaction")
+{
+    using namespace livegraph;
+    Graph graph;
+    const vertex_t num_vertices = 1000;
+    {
+        auto txn = graph.begin_transaction();
+        for (vertex_t i = 0; i < num_vertices; i++)
+            txn.put_vertex(txn.new_vertex(), "vertex");
+        txn.commit();
+    }
+    // written by several threads, whose dirty vertices are all compacted
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < 4; t++)
+    {
+        writers.emplace_back([&, t]() {
+            auto txn = graph.begin_transaction();
+            for (vertex_t i = t; i < num_vertices; i += 4)
+            {
+                txn.put_vertex(i, "new vertex");
+                txn.put_edge(i, 0, t, "edge");
+            }
+            txn.commit();
+        });
+    }
+    for (auto &writer : writers)
+        writer.join();
+    {
+        auto txn = graph.begin_transaction();
+        txn.new_vertex();
+        txn.commit();
+    }
+
+    CHECK(graph.stats().num_garbage_blocks >= num_vertices);
+    graph.compact_all(2);
+    CHECK(graph.stats().num_garbage_blocks == 0);
+    auto txn = graph.begin_read_only_transaction();
+    for (vertex_t i = 0; i < num_vertices; i++)
+    {
+        CHECK(txn.get_vertex(i) == "new vertex");
+        CHECK(txn.get_edges(i, 0).dst_id() == i % 4);
+    }
+}
+
+TEST_CASE("testing the Graph: incremental compaction")
+{
+    using namespace livegraph;
+    Graph graph;
+    // large enough to be compacted in slices
+    const vertex_t num_edges = 20000;
+    const std::string data(64, 'e');
+    {
+        auto txn = graph.begin_transaction();
+        for (vertex_t i = 0; i < num_edges; i++)
+            txn.new_vertex();
+        for (vertex_t i = 0; i < num_edges; i++)
+            txn.put_edge(0, 0, i, data);
+        txn.commit();
+    }
+    {
+        auto txn = graph.begin_transaction();
+        for (vertex_t i = 0; i < num_edges; i += 2)
+            txn.del_edge(0, 0, i);
+        txn.commit();
+    }
+    CHECK(graph.stats().num_deleted_edges == num_edges / 2);
+
+    for (size_t pass = 0; pass < 2; pass++)
+    {
+        auto txn = graph.begin_transaction();
+        txn.new_vertex();
+        txn.commit();
+        graph.compact();
+    }
+    auto stats = graph.stats();
+    CHECK(stats.num_deleted_edges == 0);
+    CHECK(stats.num_garbage_blocks == 0);
+
+    auto txn = graph.begin_read_only_transaction();
+    auto edges = txn.get_edges(0, 0);
+    vertex_t num_live = 0;
+    for (; edges.valid(); edges.next())
+    {
+        CHECK(edges.dst_id() % 2 == 1);
+        CHECK(edges.edge_data() == data);
+        num_live++;
+    }
+    CHECK(num_live == num_edges / 2);
+    for (vertex_t i = 0; i < 10; i++)
+        CHECK(txn.get_edge(0, 0, i).empty() == (i % 2 == 0));
+}
+
+TEST_CASE("testing the Graph: dirty vertices")
+{
+    using namespace livegraph;
+    Graph graph;
+    {
+        auto txn = graph.begin_transaction();
+        txn.put_vertex(txn.new_vertex(), "vertex");
+        txn.commit();
+    }
+    // written by a thread which is gone, and compacted by another one
+    std::thread writer([&]() {
+        auto txn = graph.begin_transaction();
+        txn.put_vertex(0, "new vertex");
+        txn.commit();
+    });
+    writer.join();
+    {
+        auto txn = graph.begin_transaction();
+        txn.new_vertex();
+        txn.commit();
+    }
+    CHECK(graph.stats().num_garbage_blocks == 1);
+    graph.compact();
+    CHECK(graph.stats().num_garbage_blocks == 0);
+    CHECK(graph.begin_read_only_transaction().get_vertex(0) == "new vertex");
+}
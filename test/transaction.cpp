@@ -88,6 +88,16 @@ TEST_CASE("testing the Transaction: new_vertex")
         auto txn = graph.begin_transaction();
         CHECK(txn.new_vertex(true) == 11);
     }
+
+    Graph small_graph("", "", 1ul << 30, 2);
+    {
+        auto txn = small_graph.begin_transaction();
+        CHECK(txn.new_vertex() == 0);
+        CHECK(txn.new_vertex() == 1);
+        CHECK_THROWS_AS(txn.new_vertex(), std::invalid_argument);
+        txn.commit();
+        CHECK(small_graph.get_max_vertex_id() == 2);
+    }
 }
 
 TEST_CASE("testing the Transaction: put/get/del_vertex")
@@ -473,3 +483,47 @@ TEST_CASE("testing the Transaction: put/get/del_edge")
         CHECK_THROWS_AS(txn.get_edge(0, 0, 1), std::invalid_argument);
     }
 }
+
+TEST_CASE("testing the Transaction: get_edges_batch")
+{
+    for (std::string block_path : {"", "./blocks"})
+    {
+        Graph graph(block_path, "", 1ul << 32, 1ul << 20);
+        const vertex_t vertices = 64;
+        {
+            auto txn = graph.begin_transaction();
+            for (vertex_t i = 0; i < vertices; i++)
+                txn.new_vertex();
+            for (vertex_t i = 0; i < vertices; i++)
+                for (vertex_t j = 0; j < i; j++)
+                    txn.put_edge(i, i % 2, j, std::to_string(j));
+            txn.commit();
+        }
+
+        std::vector<std::pair<vertex_t, label_t>> edges;
+        for (vertex_t i = 0; i < vertices; i++)
+            edges.emplace_back(i, i % 4); // half of the labels have no edges
+        edges.emplace_back(vertices, 0);
+
+        for (bool reverse : {false, true})
+        {
+            auto txn = graph.begin_read_only_transaction();
+            auto iterators = txn.get_edges_batch(edges, reverse);
+            CHECK(iterators.size() == edges.size());
+            for (size_t k = 0; k < edges.size(); k++)
+            {
+                auto [src, label] = edges[k];
+                auto expected = txn.get_edges(src, label, reverse);
+                for (; expected.valid(); expected.next(), iterators[k].next())
+                {
+                    CHECK(iterators[k].valid());
+                    CHECK(iterators[k].dst_id() == expected.dst_id());
+                    CHECK(iterators[k].edge_data() == expected.edge_data());
+                }
+                CHECK(!iterators[k].valid());
+                CHECK((label == src % 2 && src > 0 && src < vertices) == txn.get_edges(src, label).valid());
+            }
+        }
+    }
+    CHECK(std::remove("./blocks") == 0);
+}
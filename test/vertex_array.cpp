@@ -0,0 +1,53 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <doctest/doctest.h>
+
+#include <cstdint>
+#include <thread>
+
+#include "core/vertex_array.hpp"
+
+using namespace livegraph;
+
+TEST_CASE("testing the VertexArray")
+{
+    VertexArray<uintptr_t> array;
+    array.grow(1);
+    CHECK(array[0] == 0);
+    array[0] = 1;
+
+    // across chunks of growing sizes
+    const vertex_t size = 1ul << 16;
+    array.grow(size);
+    CHECK(array[0] == 1);
+    for (vertex_t i = 0; i < size; i++)
+        array[i] = i;
+    array.grow(size / 2);
+    array.grow(size * 4);
+    for (vertex_t i = 0; i < size; i++)
+        CHECK(array[i] == i);
+    CHECK(array[size * 4 - 1] == 0);
+    CHECK_THROWS_AS(array.grow(UINT64_MAX), std::invalid_argument);
+
+    // readers do not lock while the array grows
+    std::thread writer([&]() {
+        for (vertex_t i = size * 4; i < size * 16; i += 1000)
+            array.grow(i);
+    });
+    for (size_t round = 0; round < 100; round++)
+        CHECK(array[round * 100] == round * 100);
+    writer.join();
+}
@@ -0,0 +1,118 @@
+/* Copyright 2020 Guanyu Feng, Tsinghua University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <doctest/doctest.h>
+
+#include <string>
+#include <vector>
+
+#include "core/wal.hpp"
+
+using namespace livegraph;
+
+template <typename T> static void append(std::string &log, T data)
+{
+    log.append(reinterpret_cast<char *>(&data), sizeof(T));
+}
+
+static void append(std::string &log, std::string_view data)
+{
+    append(log, data.size());
+    log.append(data);
+}
+
+TEST_CASE("testing the wal_checksum")
+{
+    std::string data = "0123456789abcdefghijklmnopqrstuvwxyz";
+    CHECK(wal_checksum(data) != 0);
+    CHECK(wal_checksum(data) == wal_checksum(data));
+    CHECK(wal_checksum(data) != wal_checksum(data.substr(1)));
+    for (size_t i = 0; i <= data.size(); i++)
+    {
+        std::string_view view(data);
+        CHECK(wal_checksum(view.substr(i), wal_checksum(view.substr(0, i))) == wal_checksum(data));
+    }
+}
+
+TEST_CASE("testing the WALReader")
+{
+    std::string txn;
+    append(txn, (uint64_t)5);
+    append(txn, (timestamp_t)3);
+    append(txn, (timestamp_t)7);
+    append(txn, OPType::NewVertex);
+    append(txn, (vertex_t)1);
+    append(txn, OPType::PutVertex);
+    append(txn, (vertex_t)1);
+    append(txn, std::string_view("vertex"));
+    append(txn, OPType::PutEdge);
+    append(txn, (vertex_t)1);
+    append(txn, (label_t)2);
+    append(txn, (vertex_t)0);
+    append(txn, true);
+    append(txn, std::string_view("edge"));
+    append(txn, OPType::DelEdge);
+    append(txn, (vertex_t)1);
+    append(txn, (label_t)2);
+    append(txn, (vertex_t)0);
+    append(txn, OPType::DelVertex);
+    append(txn, (vertex_t)1);
+    append(txn, false);
+
+    std::string log;
+    append(log, WALGroupHeader{4, 1, txn.size(), wal_checksum(txn), 2});
+    log.append(txn);
+
+    WALGroupHeader header;
+    CHECK(check_wal_group(log, 3, header) == log.size());
+    CHECK(header.epoch_id == 4);
+    CHECK(header.num_txns == 1);
+    CHECK(header.prev_epoch_id == 2);
+    CHECK(check_wal_group(log, 2, header) == log.size());
+    CHECK(check_wal_group(log, 4, header) == 0);
+    CHECK(check_wal_group(std::string_view(log).substr(0, log.size() - 1), 3, header) == 0);
+    CHECK(check_wal_group(std::string(log.size(), '\0'), 3, header) == 0);
+
+    std::string unordered = log;
+    reinterpret_cast<WALGroupHeader *>(unordered.data())->prev_epoch_id = 4;
+    CHECK(check_wal_group(unordered, 3, header) == 0);
+
+    std::string corrupted = log;
+    corrupted.back() ^= 1;
+    CHECK(check_wal_group(corrupted, 3, header) == 0);
+
+    std::vector<WALOperation> ops;
+    WALReader reader(std::string_view(log).substr(sizeof(WALGroupHeader)));
+    reader.read_transaction([&](const WALOperation &op) { ops.push_back(op); });
+    CHECK(reader.empty());
+    CHECK(ops.size() == 5);
+    CHECK(ops[0].type == OPType::NewVertex);
+    CHECK(ops[0].src == 1);
+    CHECK(ops[1].type == OPType::PutVertex);
+    CHECK(ops[1].data == "vertex");
+    CHECK(ops[2].type == OPType::PutEdge);
+    CHECK(ops[2].src == 1);
+    CHECK(ops[2].label == 2);
+    CHECK(ops[2].dst == 0);
+    CHECK(ops[2].flag == true);
+    CHECK(ops[2].data == "edge");
+    CHECK(ops[3].type == OPType::DelEdge);
+    CHECK(ops[3].label == 2);
+    CHECK(ops[4].type == OPType::DelVertex);
+    CHECK(ops[4].flag == false);
+
+    WALReader truncated(std::string_view(txn).substr(0, txn.size() - 1));
+    CHECK_THROWS_AS(truncated.read_transaction([](const WALOperation &) {}), std::runtime_error);
+}